@@ -70,5 +70,47 @@ _project("SoftwareRenderer")
 			"gdi32",
 		}
 	
+	filter { "system:not windows" }
+		links {
+			"pthread",
+		}
+	
 	filter {}
 
+_project("MeshConverter")
+	location("../MeshConverter")
+	
+	debugdir("../")
+	
+	targetname("meshconverter")
+	kind("ConsoleApp")
+	
+	characterset("MBCS")
+	
+	objdir("../MeshConverter/build/%{cfg.platform}/%{cfg.buildcfg}/")
+	targetdir("../MeshConverter/bin/%{cfg.platform}/%{cfg.buildcfg}/")
+	
+	defines {
+		os.host():upper(),
+		"NOMINMAX",
+		"USE_SIMD"
+	}
+	
+	files {
+		"../tools/meshconverter/**.cpp",
+		"../src/Renderer/mesh.*",
+		"../src/System/mappedfile.*",
+		"../src/System/threadpool.*"
+	}
+	
+	filter { "configurations:Release" }
+		defines {
+			"NDEBUG"
+		}
+	
+	filter { "system:not windows" }
+		links {
+			"pthread",
+		}
+	
+	filter {}
@@ -33,6 +33,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <algorithm>
 #include <cmath>
+#include <cstring>
 
 
 constexpr double Pi = 3.1415926535897932384626433832795;
@@ -104,6 +105,17 @@ inline T SmoothStep(T v, T lb, T ub) {
 	return val*val*(3.0f - 2.0f*val);
 }
 
+//log2 for positive values, within 0.005 of the exact result
+inline float FastLog2(float v) {
+	int bits;
+	memcpy(&bits, &v, sizeof(bits));
+	float exponent = (float)(((bits >> 23) & 0xFF) - 127);
+	bits = (bits & 0x007FFFFF) | 0x3F800000;
+	float mantissa;
+	memcpy(&mantissa, &bits, sizeof(mantissa));
+	return exponent + (-0.34484843f * mantissa + 2.02466578f) * mantissa - 1.67487759f;
+}
+
 
 
 #endif //MATH_HPP
\ No newline at end of file
@@ -0,0 +1,253 @@
+/*
+Copyright © 2018, Marko Ranta
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+//Batched vertex transforms over structure of arrays data. ~MaGetzUb
+#ifndef TRANSFORM_HPP
+#define TRANSFORM_HPP
+
+#include "math.hpp"
+#include "matrix.hpp"
+#include "vec3.hpp"
+
+//Clip outcode bits, x < -w, x > w, y < -w, y > w, z < -w and z > w.
+enum ClipOutCode : unsigned {
+	ClipLeft   = 1 << 0,
+	ClipRight  = 1 << 1,
+	ClipBottom = 1 << 2,
+	ClipTop    = 1 << 3,
+	ClipNear   = 1 << 4,
+	ClipFar    = 1 << 5
+};
+
+struct BoundingBox {
+	vec3 min;
+	vec3 max;
+};
+
+struct BoundingSphere {
+	vec3 center;
+	float radius;
+};
+
+enum class Containment {
+	Outside,
+	Intersecting,
+	Inside
+};
+
+struct SoAVec3 {
+	const float* x;
+	const float* y;
+	const float* z;
+};
+
+struct SoAVec4Out {
+	float* x;
+	float* y;
+	float* z;
+	float* w;
+};
+
+#if defined(USE_SIMD) && defined(__AVX2__)
+
+//8 vertices per iteration
+typedef __m256 BatchFloat;
+typedef __m256i BatchInt;
+constexpr int BatchWidth = 8;
+
+inline BatchFloat BatchLoad(const float* p) { return _mm256_loadu_ps(p); }
+inline void BatchStore(float* p, BatchFloat v) { _mm256_storeu_ps(p, v); }
+inline void BatchStore(unsigned* p, BatchInt v) { _mm256_storeu_si256((__m256i*)p, v); }
+inline BatchFloat BatchSet(float v) { return _mm256_set1_ps(v); }
+inline BatchFloat BatchAdd(BatchFloat a, BatchFloat b) { return _mm256_add_ps(a, b); }
+inline BatchFloat BatchMul(BatchFloat a, BatchFloat b) { return _mm256_mul_ps(a, b); }
+inline BatchFloat BatchDiv(BatchFloat a, BatchFloat b) { return _mm256_div_ps(a, b); }
+inline BatchFloat BatchNeg(BatchFloat a) { return _mm256_xor_ps(a, _mm256_set1_ps(-0.f)); }
+inline BatchInt BatchBit(BatchFloat less, BatchFloat greater, unsigned bit) {
+	return _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(less, greater, _CMP_LT_OQ)), _mm256_set1_epi32(bit));
+}
+inline BatchInt BatchOr(BatchInt a, BatchInt b) { return _mm256_or_si256(a, b); }
+
+#elif defined(USE_SIMD)
+
+//4 vertices per iteration
+typedef __m128 BatchFloat;
+typedef __m128i BatchInt;
+constexpr int BatchWidth = 4;
+
+inline BatchFloat BatchLoad(const float* p) { return _mm_loadu_ps(p); }
+inline void BatchStore(float* p, BatchFloat v) { _mm_storeu_ps(p, v); }
+inline void BatchStore(unsigned* p, BatchInt v) { _mm_storeu_si128((__m128i*)p, v); }
+inline BatchFloat BatchSet(float v) { return _mm_set1_ps(v); }
+inline BatchFloat BatchAdd(BatchFloat a, BatchFloat b) { return _mm_add_ps(a, b); }
+inline BatchFloat BatchMul(BatchFloat a, BatchFloat b) { return _mm_mul_ps(a, b); }
+inline BatchFloat BatchDiv(BatchFloat a, BatchFloat b) { return _mm_div_ps(a, b); }
+inline BatchFloat BatchNeg(BatchFloat a) { return _mm_xor_ps(a, _mm_set1_ps(-0.f)); }
+inline BatchInt BatchBit(BatchFloat less, BatchFloat greater, unsigned bit) {
+	return _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(less, greater)), _mm_set1_epi32(bit));
+}
+inline BatchInt BatchOr(BatchInt a, BatchInt b) { return _mm_or_si128(a, b); }
+
+#endif
+
+//Row r of matrix times (x, y, z, w), summed in the same order as operator*(mat4, vec4), 
+//so batched and single vertex transforms give the very same results.
+inline float TransformRow(const mat4& m, int r, float x, float y, float z, float w) {
+	return (x * m.at(0, r) + y * m.at(1, r)) + (z * m.at(2, r) + w * m.at(3, r));
+}
+
+inline unsigned OutCode(float x, float y, float z, float w) {
+	return (x < -w ? (unsigned)ClipLeft : 0u) | (w < x ? (unsigned)ClipRight : 0u) | 
+	       (y < -w ? (unsigned)ClipBottom : 0u) | (w < y ? (unsigned)ClipTop : 0u) | 
+	       (z < -w ? (unsigned)ClipNear : 0u) | (w < z ? (unsigned)ClipFar : 0u);
+}
+
+//Transforms count points (w = 1) into clip space and computes their outcodes, 
+//unless outCodes is null. Optionally the clip space positions are also taken through the viewport matrix 
+//and divided by w, the results go into screen, which may have null members.
+inline void TransformPoints(const mat4& m, const SoAVec3& in, unsigned count, const SoAVec4Out& clip, unsigned* outCodes, const mat4* viewport = nullptr, const SoAVec4Out* screen = nullptr) {
+	unsigned i = 0;
+
+	#ifdef USE_SIMD
+	BatchFloat m00 = BatchSet(m.at(0, 0)), m10 = BatchSet(m.at(1, 0)), m20 = BatchSet(m.at(2, 0)), m30 = BatchSet(m.at(3, 0));
+	BatchFloat m01 = BatchSet(m.at(0, 1)), m11 = BatchSet(m.at(1, 1)), m21 = BatchSet(m.at(2, 1)), m31 = BatchSet(m.at(3, 1));
+	BatchFloat m02 = BatchSet(m.at(0, 2)), m12 = BatchSet(m.at(1, 2)), m22 = BatchSet(m.at(2, 2)), m32 = BatchSet(m.at(3, 2));
+	BatchFloat m03 = BatchSet(m.at(0, 3)), m13 = BatchSet(m.at(1, 3)), m23 = BatchSet(m.at(2, 3)), m33 = BatchSet(m.at(3, 3));
+	BatchFloat one = BatchSet(1.f);
+
+	for(; i + BatchWidth <= count; i += BatchWidth) {
+		BatchFloat x = BatchLoad(in.x + i), y = BatchLoad(in.y + i), z = BatchLoad(in.z + i);
+
+		BatchFloat cx = BatchAdd(BatchAdd(BatchMul(x, m00), BatchMul(y, m10)), BatchAdd(BatchMul(z, m20), BatchMul(one, m30)));
+		BatchFloat cy = BatchAdd(BatchAdd(BatchMul(x, m01), BatchMul(y, m11)), BatchAdd(BatchMul(z, m21), BatchMul(one, m31)));
+		BatchFloat cz = BatchAdd(BatchAdd(BatchMul(x, m02), BatchMul(y, m12)), BatchAdd(BatchMul(z, m22), BatchMul(one, m32)));
+		BatchFloat cw = BatchAdd(BatchAdd(BatchMul(x, m03), BatchMul(y, m13)), BatchAdd(BatchMul(z, m23), BatchMul(one, m33)));
+
+		BatchStore(clip.x + i, cx);
+		BatchStore(clip.y + i, cy);
+		BatchStore(clip.z + i, cz);
+		BatchStore(clip.w + i, cw);
+
+		BatchFloat nw = BatchNeg(cw);
+		BatchInt codes = BatchOr(BatchOr(BatchBit(cx, nw, ClipLeft), BatchBit(cw, cx, ClipRight)), BatchOr(BatchBit(cy, nw, ClipBottom), BatchBit(cw, cy, ClipTop)));
+		codes = BatchOr(codes, BatchOr(BatchBit(cz, nw, ClipNear), BatchBit(cw, cz, ClipFar)));
+		if(outCodes) BatchStore(outCodes + i, codes);
+
+		if(viewport) {
+			const mat4& v = *viewport;
+			BatchFloat sx = BatchAdd(BatchAdd(BatchMul(cx, BatchSet(v.at(0, 0))), BatchMul(cy, BatchSet(v.at(1, 0)))), BatchAdd(BatchMul(cz, BatchSet(v.at(2, 0))), BatchMul(cw, BatchSet(v.at(3, 0)))));
+			BatchFloat sy = BatchAdd(BatchAdd(BatchMul(cx, BatchSet(v.at(0, 1))), BatchMul(cy, BatchSet(v.at(1, 1)))), BatchAdd(BatchMul(cz, BatchSet(v.at(2, 1))), BatchMul(cw, BatchSet(v.at(3, 1)))));
+			BatchFloat sz = BatchAdd(BatchAdd(BatchMul(cx, BatchSet(v.at(0, 2))), BatchMul(cy, BatchSet(v.at(1, 2)))), BatchAdd(BatchMul(cz, BatchSet(v.at(2, 2))), BatchMul(cw, BatchSet(v.at(3, 2)))));
+			BatchFloat sw = BatchAdd(BatchAdd(BatchMul(cx, BatchSet(v.at(0, 3))), BatchMul(cy, BatchSet(v.at(1, 3)))), BatchAdd(BatchMul(cz, BatchSet(v.at(2, 3))), BatchMul(cw, BatchSet(v.at(3, 3)))));
+			BatchStore(screen->x + i, BatchDiv(sx, sw));
+			BatchStore(screen->y + i, BatchDiv(sy, sw));
+			BatchStore(screen->z + i, BatchDiv(sz, sw));
+			BatchStore(screen->w + i, sw);
+		}
+	}
+	#endif 
+
+	for(; i < count; i++) {
+		float x = in.x[i], y = in.y[i], z = in.z[i];
+		float cx = TransformRow(m, 0, x, y, z, 1.f);
+		float cy = TransformRow(m, 1, x, y, z, 1.f);
+		float cz = TransformRow(m, 2, x, y, z, 1.f);
+		float cw = TransformRow(m, 3, x, y, z, 1.f);
+		clip.x[i] = cx;
+		clip.y[i] = cy;
+		clip.z[i] = cz;
+		clip.w[i] = cw;
+		if(outCodes) outCodes[i] = OutCode(cx, cy, cz, cw);
+		if(viewport) {
+			float sw = TransformRow(*viewport, 3, cx, cy, cz, cw);
+			screen->x[i] = TransformRow(*viewport, 0, cx, cy, cz, cw) / sw;
+			screen->y[i] = TransformRow(*viewport, 1, cx, cy, cz, cw) / sw;
+			screen->z[i] = TransformRow(*viewport, 2, cx, cy, cz, cw) / sw;
+			screen->w[i] = sw;
+		}
+	}
+}
+
+//Transforms count directions (w = 0), like normals. The w member of out is ignored.
+inline void TransformDirections(const mat4& m, const SoAVec3& in, unsigned count, const SoAVec4Out& out) {
+	unsigned i = 0;
+
+	#ifdef USE_SIMD
+	BatchFloat m00 = BatchSet(m.at(0, 0)), m10 = BatchSet(m.at(1, 0)), m20 = BatchSet(m.at(2, 0)), m30 = BatchSet(m.at(3, 0));
+	BatchFloat m01 = BatchSet(m.at(0, 1)), m11 = BatchSet(m.at(1, 1)), m21 = BatchSet(m.at(2, 1)), m31 = BatchSet(m.at(3, 1));
+	BatchFloat m02 = BatchSet(m.at(0, 2)), m12 = BatchSet(m.at(1, 2)), m22 = BatchSet(m.at(2, 2)), m32 = BatchSet(m.at(3, 2));
+	BatchFloat zero = BatchSet(0.f);
+
+	for(; i + BatchWidth <= count; i += BatchWidth) {
+		BatchFloat x = BatchLoad(in.x + i), y = BatchLoad(in.y + i), z = BatchLoad(in.z + i);
+		BatchStore(out.x + i, BatchAdd(BatchAdd(BatchMul(x, m00), BatchMul(y, m10)), BatchAdd(BatchMul(z, m20), BatchMul(zero, m30))));
+		BatchStore(out.y + i, BatchAdd(BatchAdd(BatchMul(x, m01), BatchMul(y, m11)), BatchAdd(BatchMul(z, m21), BatchMul(zero, m31))));
+		BatchStore(out.z + i, BatchAdd(BatchAdd(BatchMul(x, m02), BatchMul(y, m12)), BatchAdd(BatchMul(z, m22), BatchMul(zero, m32))));
+	}
+	#endif
+
+	for(; i < count; i++) {
+		float x = in.x[i], y = in.y[i], z = in.z[i];
+		out.x[i] = TransformRow(m, 0, x, y, z, 0.f);
+		out.y[i] = TransformRow(m, 1, x, y, z, 0.f);
+		out.z[i] = TransformRow(m, 2, x, y, z, 0.f);
+	}
+}
+
+//Tells whether bounds transformed by m are outside, partially inside or fully inside the 
+//view volume. The sphere is tested against the clip planes first, the box corners are 
+//only transformed when the sphere straddles a plane.
+inline Containment ClassifyBounds(const mat4& m, const BoundingSphere& sphere, const BoundingBox& box) {
+	bool inside = true;
+	for(int i = 0; i < 6; i++) {
+		//w + x >= 0, w - x >= 0, w + y >= 0 and so on.
+		int r = i >> 1;
+		float s = (i & 1) ? -1.f : 1.f;
+		float a = m.at(0, 3) + s * m.at(0, r);
+		float b = m.at(1, 3) + s * m.at(1, r);
+		float c = m.at(2, 3) + s * m.at(2, r);
+		float d = m.at(3, 3) + s * m.at(3, r);
+		float distance = a * sphere.center.x + b * sphere.center.y + c * sphere.center.z + d;
+		float radius = sphere.radius * std::sqrt(a * a + b * b + c * c);
+		if(distance < -radius) return Containment::Outside;
+		if(distance < radius) inside = false;
+	}
+	if(inside) return Containment::Inside;
+
+	unsigned all = ~0u, any = 0;
+	for(int i = 0; i < 8; i++) {
+		float x = (i & 1) ? box.max.x : box.min.x;
+		float y = (i & 2) ? box.max.y : box.min.y;
+		float z = (i & 4) ? box.max.z : box.min.z;
+		unsigned code = OutCode(TransformRow(m, 0, x, y, z, 1.f), TransformRow(m, 1, x, y, z, 1.f), TransformRow(m, 2, x, y, z, 1.f), TransformRow(m, 3, x, y, z, 1.f));
+		all &= code;
+		any |= code;
+	}
+	if(all) return Containment::Outside;
+	return any ? Containment::Intersecting : Containment::Inside;
+}
+
+#endif //TRANSFORM_HPP
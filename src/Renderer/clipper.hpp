@@ -0,0 +1,180 @@
+/*
+Copyright © 2018, Marko Ranta
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CLIPPER_HPP
+#define CLIPPER_HPP
+
+#include "vertex.hpp"
+#include "../Math/transform.hpp"
+
+//Sutherland-Hodgman clipper against the clip space planes -w <= x, y, z <= w.
+//Works in fixed size storage, so clipping a triangle never touches the heap.
+class Clipper {
+
+	public:
+
+		enum Planes : unsigned {
+			Left   = ClipLeft,   //x < -w
+			Right  = ClipRight,  //x >  w
+			Bottom = ClipBottom, //y < -w
+			Top    = ClipTop,    //y >  w
+			Near   = ClipNear,   //z < -w
+			Far    = ClipFar,    //z >  w
+			AllPlanes = Left | Right | Bottom | Top | Near | Far
+		};
+
+		//Every plane can add at most one vertex to a convex polygon.
+		static constexpr int MaxVertices = 3 + 6;
+
+		struct Stats {
+			unsigned trivialAccepts = 0;   //Triangles fully inside the view volume
+			unsigned trivialRejects = 0;   //Triangles fully outside of one plane
+			unsigned guardBandAccepts = 0; //Triangles crossing only side planes, inside the guard band
+			unsigned clippedTriangles = 0; //Triangles which went through the clipper
+			unsigned culledTriangles = 0;  //Clipped triangles with nothing left
+			unsigned planeClips = 0;       //Clipped against a single plane
+			unsigned outputVertices = 0;   //Polygon vertices produced by clipping
+			unsigned outputTriangles = 0;  //Fan triangles produced by clipping
+		};
+
+	private:
+
+		Vertex mBuffers[2][MaxVertices];
+		int mCounts[2] = { 0, 0 };
+		int mCurrent = 0;
+
+		Stats mStats;
+
+	public:
+
+		static inline unsigned OutCode(const Vertex& v) {
+			unsigned code = 0;
+			if(v.x() < -v.w()) code |= Left;
+			if(v.x() >  v.w()) code |= Right;
+			if(v.y() < -v.w()) code |= Bottom;
+			if(v.y() >  v.w()) code |= Top;
+			if(v.z() < -v.w()) code |= Near;
+			if(v.z() >  v.w()) code |= Far;
+			return code;
+		}
+
+		//Same as OutCode, but for the left, right, bottom and top planes 
+		//pushed out to -guardBand * w <= x, y <= guardBand * w.
+		static inline unsigned GuardBandOutCode(const Vertex& v, float guardBand) {
+			float w = v.w() * guardBand;
+			unsigned code = 0;
+			if(v.x() < -w) code |= Left;
+			if(v.x() >  w) code |= Right;
+			if(v.y() < -w) code |= Bottom;
+			if(v.y() >  w) code |= Top;
+			return code;
+		}
+
+		//Clips the triangle against the planes in the mask, the resulting convex polygon 
+		//is available from vertices() and vertexCount(). Returns false if nothing is left.
+		//Side planes are placed at sideExtent * w, so they can be clipped to the guard band.
+		bool clip(const Vertex& a, const Vertex& b, const Vertex& c, unsigned planes = AllPlanes, float sideExtent = 1.f) {
+			mStats.clippedTriangles++;
+
+			mCurrent = 0;
+			mBuffers[0][0] = a;
+			mBuffers[0][1] = b;
+			mBuffers[0][2] = c;
+			mCounts[0] = 3;
+
+			for(int i = 0; i < 3; i++) {
+				for(int j = 0; j < 2; j++) {
+					if(!(planes & (1u << (i * 2 + j)))) continue;
+					mStats.planeClips++;
+					if(!clipPlane(i, j ? 1.f : -1.f, i < 2 ? sideExtent : 1.f)) {
+						mStats.culledTriangles++;
+						return false;
+					}
+				}
+			}
+
+			mStats.outputVertices += mCounts[mCurrent];
+			mStats.outputTriangles += mCounts[mCurrent] - 2;
+			return true;
+		}
+
+		inline void countTrivialAccept() { mStats.trivialAccepts++; }
+
+		inline void countTrivialReject() { mStats.trivialRejects++; }
+
+		inline void countGuardBandAccept() { mStats.guardBandAccepts++; }
+
+		inline const Vertex* vertices() const { return mBuffers[mCurrent]; }
+
+		inline int vertexCount() const { return mCounts[mCurrent]; }
+
+		inline const Stats& stats() const { return mStats; }
+
+		inline void resetStats() { mStats = Stats(); }
+
+	private:
+
+		bool clipPlane(int component, float sign, float extent) {
+			const Vertex* input = mBuffers[mCurrent];
+			int inputCount = mCounts[mCurrent];
+			Vertex* output = mBuffers[mCurrent ^ 1];
+			int outputCount = 0;
+
+			const Vertex* prev = &input[inputCount - 1];
+			float prevCmpVal = prev->xyzwComponent(component) * sign;
+			float prevW = prev->w() * extent;
+			bool prevInside = prevCmpVal <= prevW;
+
+			for(int k = 0; k < inputCount; k++) {
+				const Vertex* curr = &input[k];
+
+				float currCmpVal = curr->xyzwComponent(component) * sign;
+				float currW = curr->w() * extent;
+				bool currInside = currCmpVal <= currW;
+
+				if(currInside != prevInside) {
+					float mixAmt = (prevW - prevCmpVal) / ((prevW - prevCmpVal) - (currW - currCmpVal));
+					output[outputCount++] = Vertex::Mix(*prev, *curr, mixAmt);
+				}
+
+				if(currInside) {
+					output[outputCount++] = *curr;
+				}
+
+				prev = curr;
+				prevCmpVal = currCmpVal;
+				prevW = currW;
+				prevInside = currInside;
+			}
+
+			mCounts[mCurrent ^ 1] = outputCount;
+			mCurrent ^= 1;
+			return outputCount > 0;
+		}
+
+};
+
+#endif //CLIPPER_HPP
@@ -24,109 +24,955 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 #include "mesh.hpp"
-#include <map>
-
-//My crappy .obj file loader -MaGetzUb
-bool Mesh::load(const std::string & path) {
-	std::ifstream file;
-	file.open(path, std::ios::in);
-	if(!file.is_open()) return false;
-
-	std::string line;
-
-	std::vector<vec3> positions; //Collect all the vertex positions 
-	std::vector<vec2> texCoords; //texcoords first, 
-	std::vector<vec3> normals; //and normals before storing them into vertex array.
-
-	std::map<std::tuple<unsigned, unsigned, unsigned>, unsigned> vertices; //Map each position index, texcoord index and normal index to unique vertex.
-
-	float x, y, z;
-	while(std::getline(file, line)) {
-		std::stringstream lineStream(line);
-		std::string cmd;
-		lineStream >> cmd;
-		if(cmd == "v") {
-			lineStream >> x >> y >> z;
-			positions.push_back({ x, y, z });
-		} else if(cmd == "vt") {
-			lineStream >> x >> y;
-			texCoords.push_back({ x, y });
-		} else if(cmd == "vn") {
-			lineStream >> x >> y >> z;
-			normals.push_back({ x, y, z });
-		} else if(cmd == "f") {
-			//We have to basically duplicate
-			//vertices for many faces, especially
-			//when texture coordinates are utilized
-
-			int vpids[256]{}, vtids[256]{}, vnids[256]{};
-			unsigned faceIndices[256]{};
-			char crap;
-
-			int phase = 0;
-			int vertsPerFace = 0;
-			char peekChar;
-			do {
-
-				peekChar = lineStream.peek();
-				if((peekChar >= '0' && peekChar <= '9')) {
-					switch(phase) {
-						case 0: lineStream >> vpids[vertsPerFace]; break;
-						case 1: lineStream >> vtids[vertsPerFace]; break;
-						case 2: lineStream >> vnids[vertsPerFace]; break;
-					}
+#include "../System/mappedfile.hpp"
+#include "../System/threadpool.hpp"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static inline bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+static inline bool IsSpace(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f'; }
+
+//Parses a decimal float the way operator>> does, false leaves out untouched. The common 
+//case is exact in floats or doubles and correctly rounded, anything else goes to strtof.
+static bool ParseFloat(const char*& p, const char* end, float& out) {
+	while(p < end && IsSpace(*p)) p++;
+
+	const char* start = p;
+	bool negative = false;
+	if(p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+	unsigned long long mantissa = 0;
+	int digits = 0, exponent = 0;
+	bool any = false;
+	for(; p < end && IsDigit(*p); p++, any = true) {
+		if(digits < 19) { mantissa = mantissa * 10 + (*p - '0'); if(mantissa) digits++; }
+		else exponent++;
+	}
+	if(p < end && *p == '.') {
+		for(p++; p < end && IsDigit(*p); p++, any = true) {
+			if(digits < 19) { mantissa = mantissa * 10 + (*p - '0'); if(mantissa) digits++; exponent--; }
+		}
+	}
+	if(!any) {
+		p = start;
+		return false;
+	}
+	if(p < end && (*p == 'e' || *p == 'E')) {
+		const char* e = p + 1;
+		bool negativeExponent = false;
+		if(e < end && (*e == '-' || *e == '+')) negativeExponent = *e++ == '-';
+		if(e < end && IsDigit(*e)) {
+			int value = 0;
+			for(; e < end && IsDigit(*e); e++) value = std::min(value * 10 + (*e - '0'), 100000);
+			exponent += negativeExponent ? -value : value;
+			p = e;
+		}
+	}
+
+	static const float FloatPowers[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+	static const double Powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	if(digits < 19 && exponent >= -22 && exponent <= 22) {
+		if(mantissa <= (1u << 24) && exponent >= -10 && exponent <= 10) {
+			//Both operands are exact floats, so a single operation rounds correctly.
+			float value = exponent < 0 ? (float)mantissa / FloatPowers[-exponent] : (float)mantissa * FloatPowers[exponent];
+			out = negative ? -value : value;
+			return true;
+		}
+		if(mantissa <= (1ull << 53)) {
+			double value = exponent < 0 ? (double)mantissa / Powers[-exponent] : (double)mantissa * Powers[exponent];
+			//Rounding the double again is only wrong when it landed right between two floats.
+			unsigned long long bits;
+			memcpy(&bits, &value, sizeof(bits));
+			if((bits & 0x1FFFFFFF) != 0x10000000 && value >= 1.17549435e-38 && value <= 3.4e38) {
+				out = negative ? -(float)value : (float)value;
+				return true;
+			}
+		}
+	}
+
+	char buffer[128];
+	size_t length = std::min((size_t)(p - start), sizeof(buffer) - 1);
+	memcpy(buffer, start, length);
+	buffer[length] = '\0';
+	out = strtof(buffer, nullptr);
+	return true;
+}
+
+static inline unsigned ParseUnsigned(const char*& p, const char* end) {
+	unsigned value = 0;
+	for(; p < end && IsDigit(*p); p++) value = value * 10 + (*p - '0');
+	return value;
+}
+
+//Open addressing map from position, texcoord and normal indices to a vertex index.
+class VertexIndexTable {
+
+	struct Slot {
+		unsigned position, texCoord, normal;
+		unsigned vertex; //Empty when unused
+	};
+
+	static const unsigned Empty = ~0u;
+
+	std::vector<Slot> mSlots;
+	unsigned mCount = 0;
+
+	static inline unsigned Hash(unsigned p, unsigned t, unsigned n) {
+		//Runs of 8 positions share a neighbourhood of 16 slots, as 
+		//faces mostly refer to vertices that are close in the file.
+		unsigned h = (p >> 3) * 0x9E3779B1u;
+		h ^= h >> 16;
+		h *= 0x7FEB352Du;
+		h ^= h >> 15;
+		return (h << 4) + ((p & 7) << 1) + ((t ^ n) & 1);
+	}
+
+	void resize(size_t size) {
+		std::vector<Slot> slots(size, Slot{ 0, 0, 0, Empty });
+		unsigned mask = (unsigned)slots.size() - 1;
+		for(const Slot& slot : mSlots) {
+			if(slot.vertex == Empty) continue;
+			unsigned i = Hash(slot.position, slot.texCoord, slot.normal) & mask;
+			while(slots[i].vertex != Empty) i = (i + 1) & mask;
+			slots[i] = slot;
+		}
+		mSlots.swap(slots);
+	}
+
+	public:
+
+		//Makes room for count entries without growing.
+		void reserve(size_t count) {
+			size_t size = 1024;
+			while(size < count * 2) size *= 2;
+			if(size > mSlots.size()) resize(size);
+		}
+
+		//Returns the vertex of the indices, or stores and returns next if they are new.
+		inline unsigned findOrInsert(unsigned p, unsigned t, unsigned n, unsigned next) {
+			if((mCount + 1) * 2 > mSlots.size()) resize(mSlots.empty() ? 1024 : mSlots.size() * 2);
+			unsigned mask = (unsigned)mSlots.size() - 1;
+			for(unsigned i = Hash(p, t, n) & mask;; i = (i + 1) & mask) {
+				Slot& slot = mSlots[i];
+				if(slot.vertex == Empty) {
+					slot = { p, t, n, next };
+					mCount++;
+					return next;
 				}
+				if(slot.position == p && slot.texCoord == t && slot.normal == n) return slot.vertex;
+			}
+		}
+
+};
+
+//Records of one line aligned piece of an OBJ file. Face indices are kept as written, 
+//as the way they are adjusted depends on what came before in the whole file.
+struct ObjChunk {
+
+	struct FaceVertex {
+		unsigned position, texCoord, normal;
+	};
+
+	//Record values that were missing and come from the chunks before.
+	struct Carry {
+		unsigned char kind; //0 position, 1 texcoord, 2 normal
+		unsigned char mask; //Components to carry over
+		unsigned index;
+	};
+
+	std::vector<vec3> positions;
+	std::vector<vec2> texCoords;
+	std::vector<vec3> normals;
+
+	std::vector<FaceVertex> faceVertices;
+	std::vector<unsigned> faceSizes;
+	unsigned triangles = 0;
+
+	//First faces that had texcoords or normals before them in this chunk.
+	unsigned texCoordFace = ~0u, normalFace = ~0u;
+
+	//Last values of the records, and which of them this chunk set itself.
+	float values[3] = { 0.f, 0.f, 0.f };
+	unsigned char known = 0;
+	std::vector<Carry> carries;
+
+	//Values missing from the end of a record keep the previous ones, as with operator>>.
+	void parseValues(const char*& p, const char* end, unsigned char kind, unsigned index, unsigned count) {
+		unsigned parsed = 0;
+		while(parsed < count && ParseFloat(p, end, values[parsed])) parsed++;
+		unsigned char mask = (unsigned char)(((1u << count) - 1) & ~((1u << parsed) - 1) & ~known);
+		known |= (unsigned char)((1u << parsed) - 1);
+		if(mask) carries.push_back({ kind, mask, index });
+	}
+
+	void parse(const char* p, const char* end) {
+		while(p < end) {
+			const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+			if(!lineEnd) lineEnd = end;
 
-				if(peekChar == '/') { lineStream >> crap; phase++; }
-				
-				if(peekChar == ' ') { 
+			const char* cmd = p;
+			while(cmd < lineEnd && IsSpace(*cmd)) cmd++;
+			const char* cmdEnd = cmd;
+			while(cmdEnd < lineEnd && !IsSpace(*cmdEnd)) cmdEnd++;
+			size_t cmdLength = cmdEnd - cmd;
+			const char* q = cmdEnd;
 
-					lineStream.ignore(); 
-					if((phase % 3) == 2) 
-						vertsPerFace++; 
-					phase = 0; 
-					continue; 
+			if(cmdLength == 1 && cmd[0] == 'v') {
+				parseValues(q, lineEnd, 0, (unsigned)positions.size(), 3);
+				positions.push_back({ values[0], values[1], values[2] });
+			} else if(cmdLength == 2 && cmd[0] == 'v' && cmd[1] == 't') {
+				if(texCoordFace == ~0u) texCoordFace = (unsigned)faceSizes.size();
+				parseValues(q, lineEnd, 1, (unsigned)texCoords.size(), 2);
+				texCoords.push_back({ values[0], values[1] });
+			} else if(cmdLength == 2 && cmd[0] == 'v' && cmd[1] == 'n') {
+				if(normalFace == ~0u) normalFace = (unsigned)faceSizes.size();
+				parseValues(q, lineEnd, 2, (unsigned)normals.size(), 3);
+				normals.push_back({ values[0], values[1], values[2] });
+			} else if(cmdLength == 1 && cmd[0] == 'f') {
+				//Only position/texcoord/normal triplets count as face vertices, 
+				//a vertex ends at the space that follows it.
+				size_t first = faceVertices.size();
+				faceVertices.push_back({ 0, 0, 0 });
+				int phase = 0;
+				while(q < lineEnd) {
+					char c = *q;
+					if(IsDigit(c) && phase < 3) {
+						FaceVertex& v = faceVertices.back();
+						unsigned& id = phase == 0 ? v.position : phase == 1 ? v.texCoord : v.normal;
+						id = ParseUnsigned(q, lineEnd);
+					} else if(c == '/') {
+						phase++;
+						q++;
+					} else if(c == ' ') {
+						if((phase % 3) == 2) faceVertices.push_back({ 0, 0, 0 });
+						phase = 0;
+						q++;
+					} else {
+						q++;
+					}
 				}
 
-			} while(peekChar != EOF);
+				unsigned size = (unsigned)(faceVertices.size() - first);
+				faceSizes.push_back(size);
+				if(size > 2) triangles += size - 2;
+			}
+
+			p = lineEnd < end ? lineEnd + 1 : end;
+		}
+	}
+
+};
+
+//Runs the jobs on the pool when there is one.
+static void ForEach(ThreadPool* pool, int count, const std::function<void(int)>& job) {
+	if(pool) pool->parallelFor(count, job);
+	else for(int i = 0; i < count; i++) job(i);
+}
+
+//Binary meshes hold the arrays exactly as Mesh uses them, each section 
+//starts at a cache line so that they can be used straight from the mapping.
+struct MeshFileHeader {
+	char magic[4];
+	unsigned version;
+	unsigned vertexSize, triangleSize, meshletSize; //The arrays are raw structs, a layout change invalidates them
+	unsigned vertexCount, triangleCount;
+	float boundingBox[6];
+	float boundingSphere[4];
+	unsigned sectionCount;
+};
+
+struct MeshFileSection {
+	unsigned type;
+	unsigned reserved;
+	unsigned long long offset, size;
+};
+
+enum class MeshSection : unsigned {
+	Vertices = 1,
+	Triangles,
+	PositionStreams, //x, y and z arrays one after another
+	NormalStreams,
+	Meshlets, //Optional
+	Count
+};
+
+static const char MeshFileMagic[4] = { 'M', 'E', 'S', 'H' };
+static const unsigned MeshFileVersion = 2;
+static const unsigned long long MeshFileAlignment = 64; //Of the sections, enough for the vectors and cache lines
+
+bool Mesh::load(const std::string & path, ThreadPool* pool) {
+	MappedFile file;
+	if(!file.open(path)) {
+		//Empty files can't be mapped, but they are still valid meshes.
+		unsigned long long size, modified;
+		if(!MappedFile::Stat(path, size, modified) || size) return false;
+	}
+
+	if(file.size() >= sizeof(MeshFileMagic) && !memcmp(file.data(), MeshFileMagic, sizeof(MeshFileMagic))) return loadBinary(file);
+	return loadObj(file, pool);
+}
+
+//Binary meshes replace what the mesh had, instead of adding to it.
+bool Mesh::loadBinary(MappedFile& file) {
+	if(file.size() < sizeof(MeshFileHeader)) return false;
+
+	MeshFileHeader header;
+	memcpy(&header, file.data(), sizeof(header));
+	if(header.version != MeshFileVersion || header.vertexSize != sizeof(Vertex) || header.triangleSize != sizeof(uvec3) || header.meshletSize != sizeof(Meshlet)) return false;
+	if(sizeof(header) + (unsigned long long)header.sectionCount * sizeof(MeshFileSection) > file.size()) return false;
+
+	unsigned long long sizes[(int)MeshSection::Count] = {};
+	sizes[(int)MeshSection::Vertices] = (unsigned long long)header.vertexCount * sizeof(Vertex);
+	sizes[(int)MeshSection::Triangles] = (unsigned long long)header.triangleCount * sizeof(uvec3);
+	sizes[(int)MeshSection::PositionStreams] = (unsigned long long)header.vertexCount * 3 * sizeof(float);
+	sizes[(int)MeshSection::NormalStreams] = sizes[(int)MeshSection::PositionStreams];
+
+	//Sections of newer writers that this one doesn't know about are skipped.
+	const unsigned char* data[(int)MeshSection::Count] = {};
+	for(unsigned i = 0; i < header.sectionCount; i++) {
+		MeshFileSection section;
+		memcpy(&section, file.data() + sizeof(header) + i * sizeof(section), sizeof(section));
+		if(section.offset > file.size() || section.size > file.size() - section.offset || (section.offset & (MeshFileAlignment - 1))) return false;
+		if(section.type == 0 || section.type >= (unsigned)MeshSection::Count) continue;
+		if(section.type == (unsigned)MeshSection::Meshlets) {
+			if(section.size % sizeof(Meshlet)) return false;
+			sizes[section.type] = section.size;
+		}
+		if(section.size != sizes[section.type]) return false;
+		data[section.type] = file.data() + section.offset;
+	}
+	for(int i = 1; i < (int)MeshSection::Meshlets; i++) {
+		if(!data[i]) return false;
+	}
+
+	//Indices and meshlet ranges are used to index the transformed vertices without 
+	//checks when drawing, so a stale or corrupt file must fail here instead.
+	const unsigned* indices = (const unsigned*)data[(int)MeshSection::Triangles];
+	unsigned maxIndex = 0;
+	for(unsigned long long i = 0; i < header.triangleCount * 3ull; i++) maxIndex = std::max(maxIndex, indices[i]);
+	if(header.triangleCount && maxIndex >= header.vertexCount) return false;
+	const Meshlet* meshlets = (const Meshlet*)data[(int)MeshSection::Meshlets];
+	for(unsigned long long i = 0; i < sizes[(int)MeshSection::Meshlets] / sizeof(Meshlet); i++) {
+		const Meshlet& meshlet = meshlets[i];
+		if(meshlet.firstVertex > header.vertexCount || meshlet.vertexCount > header.vertexCount - meshlet.firstVertex) return false;
+		if(meshlet.firstTriangle > header.triangleCount || meshlet.triangleCount > header.triangleCount - meshlet.firstTriangle) return false;
+	}
+
+	std::vector<Vertex>().swap(mVertices);
+	std::vector<uvec3>().swap(mTriangles);
+	std::vector<Meshlet>().swap(mMeshlets);
+	for(std::vector<float>* stream : { &mPositionX, &mPositionY, &mPositionZ, &mNormalX, &mNormalY, &mNormalZ }) {
+		std::vector<float>().swap(*stream);
+	}
+	mFile = std::move(file);
+
+	unsigned count = header.vertexCount;
+	const float* positions = (const float*)data[(int)MeshSection::PositionStreams];
+	const float* normals = (const float*)data[(int)MeshSection::NormalStreams];
+	mVertexView = ArrayView<Vertex>((const Vertex*)data[(int)MeshSection::Vertices], count);
+	mTriangleView = ArrayView<uvec3>((const uvec3*)data[(int)MeshSection::Triangles], header.triangleCount);
+	mMeshletView = ArrayView<Meshlet>((const Meshlet*)data[(int)MeshSection::Meshlets], sizes[(int)MeshSection::Meshlets] / sizeof(Meshlet));
+	mPositionStreams = { positions, positions + count, positions + count * 2 };
+	mNormalStreams = { normals, normals + count, normals + count * 2 };
+
+	const float* box = header.boundingBox;
+	mBoundingBox = { vec3(box[0], box[1], box[2]), vec3(box[3], box[4], box[5]) };
+	mBoundingSphere = { vec3(header.boundingSphere[0], header.boundingSphere[1], header.boundingSphere[2]), header.boundingSphere[3] };
+	return true;
+}
 
+bool Mesh::saveBinary(const std::string& path) const {
+	unsigned count = vertexCount();
+	struct Array {
+		const void* data;
+		size_t size;
+	};
+	//Streams are written as one section each, from their separate arrays.
+	const Array arrays[][3] = {
+		{ { mVertexView.data(), count * sizeof(Vertex) } },
+		{ { mTriangleView.data(), triangleCount() * sizeof(uvec3) } },
+		{ { mPositionStreams.x, count * sizeof(float) }, { mPositionStreams.y, count * sizeof(float) }, { mPositionStreams.z, count * sizeof(float) } },
+		{ { mNormalStreams.x, count * sizeof(float) }, { mNormalStreams.y, count * sizeof(float) }, { mNormalStreams.z, count * sizeof(float) } },
+		{ { mMeshletView.data(), mMeshletView.size() * sizeof(Meshlet) } }
+	};
+	const unsigned SectionCount = (unsigned)MeshSection::Count - 1;
 
-			for(int i = 0; i < vertsPerFace + 1; i++) {
+	MeshFileHeader header = {};
+	memcpy(header.magic, MeshFileMagic, sizeof(MeshFileMagic));
+	header.version = MeshFileVersion;
+	header.vertexSize = sizeof(Vertex);
+	header.triangleSize = sizeof(uvec3);
+	header.meshletSize = sizeof(Meshlet);
+	header.vertexCount = count;
+	header.triangleCount = triangleCount();
+	const float box[6] = { mBoundingBox.min.x, mBoundingBox.min.y, mBoundingBox.min.z, mBoundingBox.max.x, mBoundingBox.max.y, mBoundingBox.max.z };
+	const float sphere[4] = { mBoundingSphere.center.x, mBoundingSphere.center.y, mBoundingSphere.center.z, mBoundingSphere.radius };
+	memcpy(header.boundingBox, box, sizeof(box));
+	memcpy(header.boundingSphere, sphere, sizeof(sphere));
+	header.sectionCount = SectionCount;
 
-				vpids[i]--;
-				if(texCoords.size()) vtids[i]--;
-				if(normals.size()) vnids[i]--;
+	MeshFileSection sections[SectionCount] = {};
+	unsigned long long offset = sizeof(header) + sizeof(sections);
+	for(unsigned i = 0; i < SectionCount; i++) {
+		sections[i].type = i + 1;
+		sections[i].offset = offset = (offset + MeshFileAlignment - 1) & ~(MeshFileAlignment - 1);
+		for(const Array& array : arrays[i]) sections[i].size += array.size;
+		offset += sections[i].size;
+	}
 
+	return MappedFile::Write(path, [&](std::ostream& out) {
+		char padding[MeshFileAlignment] = {};
+		out.write((const char*)&header, sizeof(header));
+		out.write((const char*)sections, sizeof(sections));
+		unsigned long long position = sizeof(header) + sizeof(sections);
+		for(unsigned i = 0; i < SectionCount; i++) {
+			out.write(padding, sections[i].offset - position);
+			for(const Array& array : arrays[i]) {
+				if(array.size) out.write((const char*)array.data, array.size);
 			}
+			position = sections[i].offset + sections[i].size;
+		}
+	});
+}
+
+void Mesh::clearMeshlets() {
+	mMeshlets.clear();
+	mMeshletView = ArrayView<Meshlet>();
+}
 
+void Mesh::ownArrays() {
+	if(!mFile.isOpen()) return;
+	mVertices.assign(mVertexView.begin(), mVertexView.end());
+	mTriangles.assign(mTriangleView.begin(), mTriangleView.end());
+	mMeshlets.assign(mMeshletView.begin(), mMeshletView.end());
+	mVertexView = ArrayView<Vertex>(mVertices.data(), mVertices.size());
+	mTriangleView = ArrayView<uvec3>(mTriangles.data(), mTriangles.size());
+	mMeshletView = ArrayView<Meshlet>(mMeshlets.data(), mMeshlets.size());
+	buildStreams();
+	mFile.close();
+}
+
+//Matches what the original stringstream based loader produced for the same input, 
+//with or without the pool, however the file gets split into chunks.
+bool Mesh::loadObj(const MappedFile& file, ThreadPool* pool) {
+	ownArrays();
 
-			for(int i = 0; i < vertsPerFace+1; i++) {
+	const char* begin = (const char*)file.data();
+	const char* end = begin + file.size();
 
-				auto vId = vertices.find({ vpids[i], vtids[i], vnids[i] }); //Find a vertex with certain position, texcoord and normal index.
+	//Chunks start after a line break, a few for each thread to even out the work.
+	static const size_t MinChunkSize = 1 << 20;
+	std::vector<const char*> bounds = { begin };
+	if(pool) {
+		size_t size = end - begin;
+		size_t count = std::min<size_t>((pool->threadCount() + 1) * 4, size / MinChunkSize + 1);
+		for(size_t i = 1; i < count; i++) {
+			const char* split = std::max(bounds.back(), begin + size * i / count);
+			const char* lineEnd = (const char*)memchr(split, '\n', end - split);
+			if(!lineEnd) break;
+			bounds.push_back(lineEnd + 1);
+		}
+	}
+	bounds.push_back(end);
 
-				if(vId == vertices.end()) { //If nothing found, we need to add it to the actual vertices, and into the map
+	int chunkCount = (int)bounds.size() - 1;
+	std::vector<ObjChunk> chunks(chunkCount);
+	ForEach(pool, chunkCount, [&](int c) { chunks[c].parse(bounds[c], bounds[c + 1]); });
 
-					vec4 pos = vec4(positions[vpids[i]]);
-					faceIndices[i] = mVertices.size(); //Get the next free index 
-					mVertices.push_back(Vertex(pos)); // * add it to the vertex list **
-					if(texCoords.size()) mVertices.back().setTexCoord(texCoords[vtids[i]]);
-					if(normals.size()) mVertices.back().setNormal(normals[vnids[i]]);
+	//Where the records of each chunk go in the whole file.
+	struct Offsets {
+		unsigned positions, texCoords, normals, faceVertices, triangles;
+	};
+	std::vector<Offsets> offsets(chunkCount + 1, Offsets{ 0, 0, 0, 0, 0 });
+	float values[3] = { 0.f, 0.f, 0.f };
+	for(int c = 0; c < chunkCount; c++) {
+		ObjChunk& chunk = chunks[c];
+		for(const ObjChunk::Carry& carry : chunk.carries) {
+			for(int k = 0; k < 3; k++) {
+				if(!(carry.mask & (1 << k))) continue;
+				if(carry.kind == 0) chunk.positions[carry.index][k] = values[k];
+				else if(carry.kind == 1) chunk.texCoords[carry.index][k] = values[k];
+				else chunk.normals[carry.index][k] = values[k];
+			}
+		}
+		for(int k = 0; k < 3; k++) {
+			if(chunk.known & (1 << k)) values[k] = chunk.values[k];
+		}
 
-					vertices[{vpids[i], vtids[i], vnids[i]}] = faceIndices[i]; //Add the vertex index into map
+		const Offsets& o = offsets[c];
+		offsets[c + 1] = {
+			o.positions + (unsigned)chunk.positions.size(),
+			o.texCoords + (unsigned)chunk.texCoords.size(),
+			o.normals + (unsigned)chunk.normals.size(),
+			o.faceVertices + (unsigned)chunk.faceVertices.size(),
+			o.triangles + chunk.triangles
+		};
+	}
+	const Offsets& total = offsets[chunkCount];
 
-				} else {
+	std::vector<vec3> positions(total.positions);
+	std::vector<vec2> texCoords(total.texCoords);
+	std::vector<vec3> normals(total.normals);
 
-					faceIndices[i] = vId->second; //** vertex with certain position, texcoord and normal indices found, get the value from the map. 
-				
-				}
+	//Indices are zero based only after the first texcoord or normal of the file.
+	ForEach(pool, chunkCount, [&](int c) {
+		ObjChunk& chunk = chunks[c];
+		std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + offsets[c].positions);
+		std::copy(chunk.texCoords.begin(), chunk.texCoords.end(), texCoords.begin() + offsets[c].texCoords);
+		std::copy(chunk.normals.begin(), chunk.normals.end(), normals.begin() + offsets[c].normals);
 
+		unsigned i = 0;
+		for(unsigned f = 0; f < chunk.faceSizes.size(); f++) {
+			bool hasTexCoords = offsets[c].texCoords || f >= chunk.texCoordFace;
+			bool hasNormals = offsets[c].normals || f >= chunk.normalFace;
+			for(unsigned end = i + chunk.faceSizes[f]; i < end; i++) {
+				ObjChunk::FaceVertex& v = chunk.faceVertices[i];
+				v.position--;
+				if(hasTexCoords) v.texCoord--;
+				if(hasNormals) v.normal--;
 			}
+		}
+	});
 
-			for(int k = 0; k < vertsPerFace-1; k++) {
-				mTriangles.emplace_back(uvec3{ faceIndices[0], faceIndices[k + 1], faceIndices[k + 2] });
+	//Each vertex belongs to the first face vertex that uses it, which every 
+	//shard of the indices finds on its own. The file order of those then 
+	//numbers the vertices, the same way as one pass through the faces would.
+	std::vector<unsigned> indices(total.faceVertices);
+	int shards = pool && total.faceVertices > MinChunkSize / 16 ? (int)pool->threadCount() + 1 : 1;
+	ForEach(pool, shards, [&](int s) {
+		VertexIndexTable table;
+		table.reserve(total.positions / shards);
+		for(int c = 0; c < chunkCount; c++) {
+			const ObjChunk& chunk = chunks[c];
+			unsigned first = offsets[c].faceVertices;
+			for(unsigned i = 0; i < chunk.faceVertices.size(); i++) {
+				const ObjChunk::FaceVertex& v = chunk.faceVertices[i];
+				if(shards > 1 && (int)((v.position >> 6) % shards) != s) continue;
+				indices[first + i] = table.findOrInsert(v.position, v.texCoord, v.normal, first + i);
 			}
+		}
+	});
 
+	unsigned firstVertex = (unsigned)mVertices.size();
+	std::vector<unsigned> sources; //First face vertex of each vertex
+	sources.reserve(total.positions);
+	for(unsigned i = 0; i < total.faceVertices; i++) {
+		if(indices[i] == i) {
+			indices[i] = firstVertex + (unsigned)sources.size();
+			sources.push_back(i);
+		} else {
+			indices[i] = indices[indices[i]];
 		}
 	}
+
+	unsigned firstTriangle = (unsigned)mTriangles.size();
+	mVertices.resize(firstVertex + sources.size());
+	mTriangles.resize(firstTriangle + total.triangles);
+	ForEach(pool, chunkCount, [&](int c) {
+		const ObjChunk& chunk = chunks[c];
+		const unsigned* faceIndices = indices.data() + offsets[c].faceVertices;
+		unsigned i = 0, t = firstTriangle + offsets[c].triangles;
+		for(unsigned f = 0; f < chunk.faceSizes.size(); f++) {
+			bool hasTexCoords = offsets[c].texCoords || f >= chunk.texCoordFace;
+			bool hasNormals = offsets[c].normals || f >= chunk.normalFace;
+			unsigned size = chunk.faceSizes[f];
+			for(unsigned k = 0; k < size; k++) {
+				unsigned vertex = faceIndices[i + k];
+				if(sources[vertex - firstVertex] != offsets[c].faceVertices + i + k) continue;
+				const ObjChunk::FaceVertex& v = chunk.faceVertices[i + k];
+				//Indices outside the records leave the defaults.
+				mVertices[vertex] = Vertex(vec4(v.position < positions.size() ? positions[v.position] : vec3()));
+				if(hasTexCoords && v.texCoord < texCoords.size()) mVertices[vertex].setTexCoord(texCoords[v.texCoord]);
+				if(hasNormals && v.normal < normals.size()) mVertices[vertex].setNormal(normals[v.normal]);
+			}
+			for(unsigned k = 2; k < size; k++) {
+				mTriangles[t++] = uvec3{ faceIndices[i], faceIndices[i + k - 1], faceIndices[i + k] };
+			}
+			i += size;
+		}
+	});
+
+	mVertexView = ArrayView<Vertex>(mVertices.data(), mVertices.size());
+	mTriangleView = ArrayView<uvec3>(mTriangles.data(), mTriangles.size());
+	clearMeshlets();
+	buildStreams();
+	computeBounds();
 	return true;
 }
+
+void Mesh::buildStreams() {
+	unsigned count = vertexCount();
+	mPositionX.resize(count);
+	mPositionY.resize(count);
+	mPositionZ.resize(count);
+	mNormalX.resize(count);
+	mNormalY.resize(count);
+	mNormalZ.resize(count);
+	for(unsigned i = 0; i < count; i++) {
+		const Vertex& v = mVertexView[i];
+		mPositionX[i] = v.x();
+		mPositionY[i] = v.y();
+		mPositionZ[i] = v.z();
+		mNormalX[i] = v.normal().x;
+		mNormalY[i] = v.normal().y;
+		mNormalZ[i] = v.normal().z;
+	}
+	mPositionStreams = { mPositionX.data(), mPositionY.data(), mPositionZ.data() };
+	mNormalStreams = { mNormalX.data(), mNormalY.data(), mNormalZ.data() };
+}
+
+void Mesh::computeBounds() {
+	if(mVertexView.empty()) {
+		mBoundingBox = {};
+		mBoundingSphere = {};
+		return;
+	}
+
+	vec3 min = mVertexView[0].xyz(), max = min;
+	for(const Vertex& v : mVertexView) {
+		min = { std::min(min.x, v.x()), std::min(min.y, v.y()), std::min(min.z, v.z()) };
+		max = { std::max(max.x, v.x()), std::max(max.y, v.y()), std::max(max.z, v.z()) };
+	}
+	mBoundingBox = { min, max };
+
+	//Centered on the box, tighter than the box's own bounding sphere for most meshes.
+	vec3 center = (min + max) * .5f;
+	float radius = 0.f;
+	for(const Vertex& v : mVertexView) {
+		radius = std::max(radius, (v.xyz() - center).length());
+	}
+	mBoundingSphere = { center, radius };
+}
+
+float Mesh::acmr(unsigned cacheSize) const {
+	if(mTriangleView.empty()) return 0.f;
+
+	//Cache slot of each vertex is its insertion time, still cached while within cacheSize of now.
+	std::vector<unsigned> inserted(vertexCount(), ~0u);
+	unsigned time = 0, misses = 0;
+	for(const uvec3& face : mTriangleView) {
+		for(int i = 0; i < 3; i++) {
+			unsigned& slot = inserted[face[i]];
+			if(slot != ~0u && time - slot < cacheSize) continue;
+			slot = time++;
+			misses++;
+		}
+	}
+	return (float)misses / mTriangleView.size();
+}
+
+//Triangles using each vertex, the ones of vertex v are from adjacency[offsets[v]] to adjacency[offsets[v + 1]].
+static void VertexTriangles(const std::vector<uvec3>& triangles, unsigned vertexCount, std::vector<unsigned>& offsets, std::vector<unsigned>& adjacency) {
+	offsets.assign(vertexCount + 1, 0);
+	for(const uvec3& face : triangles) {
+		for(int i = 0; i < 3; i++) offsets[face[i] + 1]++;
+	}
+	for(unsigned v = 0; v < vertexCount; v++) offsets[v + 1] += offsets[v];
+
+	adjacency.resize(offsets[vertexCount]);
+	std::vector<unsigned> fill(offsets.begin(), offsets.end() - 1);
+	for(unsigned t = 0; t < triangles.size(); t++) {
+		for(int i = 0; i < 3; i++) adjacency[fill[triangles[t][i]]++] = t;
+	}
+}
+
+//Tom Forsyth's linear speed vertex cache optimisation, with his constants.
+static const int ForsythCacheSize = 32;
+static const int ForsythMaxValence = 64;
+
+struct ForsythScores {
+	float cache[ForsythCacheSize + 1]; //The last one is for vertices outside the cache
+	float valence[ForsythMaxValence + 1];
+
+	ForsythScores() {
+		for(int i = 0; i < ForsythCacheSize; i++) {
+			//The vertices of the last triangle get a fixed score, so that it isn't repeated in strips.
+			cache[i] = i < 3 ? 0.75f : powf(1.f - (i - 3) / float(ForsythCacheSize - 3), 1.5f);
+		}
+		cache[ForsythCacheSize] = 0.f;
+		valence[0] = 0.f;
+		for(int i = 1; i <= ForsythMaxValence; i++) valence[i] = 2.f * powf((float)i, -0.5f);
+	}
+
+	inline float vertex(int cachePosition, unsigned remaining) const {
+		if(!remaining) return -1.f;
+		return cache[cachePosition] + valence[std::min<unsigned>(remaining, ForsythMaxValence)];
+	}
+};
+
+Mesh::Optimization Mesh::optimize() {
+	ownArrays();
+
+	Optimization result;
+	result.acmrBefore = acmr();
+
+	unsigned count = vertexCount();
+	unsigned triangles = triangleCount();
+
+	//Triangles of every vertex, the ones still to be emitted come first.
+	std::vector<unsigned> offsets, adjacency;
+	VertexTriangles(mTriangles, count, offsets, adjacency);
+	std::vector<unsigned> remaining(count);
+	for(unsigned v = 0; v < count; v++) remaining[v] = offsets[v + 1] - offsets[v];
+
+	static const ForsythScores Scores;
+	std::vector<int> cachePosition(count, ForsythCacheSize);
+	std::vector<float> vertexScores(count), triangleScores(triangles);
+	for(unsigned v = 0; v < count; v++) vertexScores[v] = Scores.vertex(ForsythCacheSize, remaining[v]);
+	for(unsigned t = 0; t < triangles; t++) {
+		const uvec3& face = mTriangles[t];
+		triangleScores[t] = vertexScores[face[0]] + vertexScores[face[1]] + vertexScores[face[2]];
+	}
+
+	std::vector<uvec3> ordered;
+	ordered.reserve(triangles);
+	std::vector<bool> emitted(triangles, false);
+	unsigned cache[ForsythCacheSize + 3], cacheCount = 0;
+	unsigned best = triangles ? (unsigned)(std::max_element(triangleScores.begin(), triangleScores.end()) - triangleScores.begin()) : 0;
+	unsigned restart = 0;
+
+	while(ordered.size() < triangles) {
+		//With nothing in the cache to continue from, the next triangle in the input order starts over.
+		if(best == ~0u) {
+			while(emitted[restart]) restart++;
+			best = restart;
+		}
+
+		const uvec3 face = mTriangles[best];
+		ordered.push_back(face);
+		emitted[best] = true;
+
+		for(int i = 0; i < 3; i++) {
+			unsigned v = face[i];
+			unsigned* first = &adjacency[offsets[v]];
+			unsigned* last = first + remaining[v] - 1;
+			*std::find(first, last, best) = *last;
+			*last = best;
+			remaining[v]--;
+		}
+
+		//The triangle's vertices go to the front, the ones pushed past the end are evicted.
+		unsigned newCache[ForsythCacheSize + 3];
+		unsigned newCount = 0;
+		for(int i = 0; i < 3; i++) {
+			if(std::find(newCache, newCache + newCount, face[i]) == newCache + newCount) newCache[newCount++] = face[i];
+		}
+		for(unsigned i = 0; i < cacheCount; i++) {
+			unsigned v = cache[i];
+			if(v != face[0] && v != face[1] && v != face[2]) newCache[newCount++] = v;
+		}
+		for(unsigned i = 0; i < newCount; i++) {
+			unsigned v = newCache[i];
+			cachePosition[v] = i < ForsythCacheSize ? (int)i : ForsythCacheSize;
+			vertexScores[v] = Scores.vertex(cachePosition[v], remaining[v]);
+		}
+
+		//Only the triangles touching a changed vertex change their scores.
+		best = ~0u;
+		float bestScore = -1.f;
+		for(unsigned i = 0; i < newCount; i++) {
+			unsigned v = newCache[i];
+			for(unsigned k = offsets[v], end = offsets[v] + remaining[v]; k < end; k++) {
+				unsigned t = adjacency[k];
+				const uvec3& other = mTriangles[t];
+				float score = triangleScores[t] = vertexScores[other[0]] + vertexScores[other[1]] + vertexScores[other[2]];
+				if(score > bestScore) {
+					bestScore = score;
+					best = t;
+				}
+			}
+		}
+
+		cacheCount = std::min<unsigned>(newCount, ForsythCacheSize);
+		std::copy(newCache, newCache + cacheCount, cache);
+	}
+
+	//Vertices are then stored in the order the triangles first use them, unused ones last.
+	std::vector<unsigned> remap(count, ~0u);
+	std::vector<Vertex> vertices;
+	vertices.reserve(count);
+	for(uvec3& face : ordered) {
+		for(int i = 0; i < 3; i++) {
+			unsigned& index = remap[face[i]];
+			if(index == ~0u) {
+				index = (unsigned)vertices.size();
+				vertices.push_back(mVertices[face[i]]);
+			}
+			face[i] = index;
+		}
+	}
+	for(unsigned v = 0; v < count; v++) {
+		if(remap[v] == ~0u) vertices.push_back(mVertices[v]);
+	}
+
+	mVertices.swap(vertices);
+	mTriangles.swap(ordered);
+	mVertexView = ArrayView<Vertex>(mVertices.data(), mVertices.size());
+	mTriangleView = ArrayView<uvec3>(mTriangles.data(), mTriangles.size());
+	clearMeshlets();
+	buildStreams();
+
+	result.acmrAfter = acmr();
+	return result;
+}
+
+void Mesh::buildMeshlets(unsigned maxVertices, unsigned maxTriangles) {
+	ownArrays();
+
+	unsigned count = vertexCount();
+	unsigned triangles = triangleCount();
+
+	std::vector<unsigned> offsets, adjacency;
+	VertexTriangles(mTriangles, count, offsets, adjacency);
+
+	std::vector<vec3> centroids(triangles);
+	for(unsigned t = 0; t < triangles; t++) {
+		const uvec3& face = mTriangles[t];
+		centroids[t] = (mVertices[face[0]].xyz() + mVertices[face[1]].xyz() + mVertices[face[2]].xyz()) * (1.f / 3.f);
+	}
+
+	std::vector<Vertex> vertices;
+	std::vector<uvec3> faces;
+	std::vector<Meshlet> meshlets;
+	faces.reserve(triangles);
+
+	std::vector<bool> assigned(triangles, false);
+	std::vector<unsigned> local(count, ~0u); //Index of each vertex in the meshlet being built
+	std::vector<unsigned> candidateOf(triangles, ~0u); //Last meshlet that had the triangle as a candidate
+	std::vector<unsigned> meshletVertices, candidates;
+	unsigned restart = 0;
+
+	while(faces.size() < triangles) {
+		//Meshlets continue next to the previous one, or from the next triangle in order.
+		unsigned next = ~0u;
+		for(unsigned t : candidates) {
+			if(!assigned[t]) {
+				next = t;
+				break;
+			}
+		}
+		if(next == ~0u) {
+			while(assigned[restart]) restart++;
+			next = restart;
+		}
+		candidates.clear();
+
+		unsigned index = (unsigned)meshlets.size();
+		Meshlet meshlet = {};
+		meshlet.firstVertex = (unsigned)vertices.size();
+		meshlet.firstTriangle = (unsigned)faces.size();
+		vec3 center = centroids[next];
+
+		//Grows by the neighbouring triangle that adds the fewest vertices, the nearest one of those.
+		while(next != ~0u) {
+			const uvec3& face = mTriangles[next];
+			uvec3 remapped;
+			for(int i = 0; i < 3; i++) {
+				unsigned v = face[i];
+				if(local[v] == ~0u) {
+					local[v] = (unsigned)meshletVertices.size();
+					meshletVertices.push_back(v);
+					for(unsigned k = offsets[v]; k < offsets[v + 1]; k++) {
+						unsigned t = adjacency[k];
+						if(!assigned[t] && candidateOf[t] != index) {
+							candidateOf[t] = index;
+							candidates.push_back(t);
+						}
+					}
+				}
+				remapped[i] = meshlet.firstVertex + local[v];
+			}
+			faces.push_back(remapped);
+			assigned[next] = true;
+			meshlet.triangleCount++;
+			center += (centroids[next] - center) * (1.f / meshlet.triangleCount);
+			if(meshlet.triangleCount == maxTriangles) break;
+
+			next = ~0u;
+			unsigned bestAdded = 4;
+			float bestDistance = 0.f;
+			auto Consider = [&](unsigned t) {
+				const uvec3& other = mTriangles[t];
+				unsigned added = (local[other[0]] == ~0u) + (local[other[1]] == ~0u) + (local[other[2]] == ~0u);
+				if(meshletVertices.size() + added > maxVertices || added > bestAdded) return;
+				float distance = (centroids[t] - center).magnitude();
+				if(added < bestAdded || distance < bestDistance) {
+					next = t;
+					bestAdded = added;
+					bestDistance = distance;
+				}
+			};
+
+			size_t kept = 0;
+			for(unsigned t : candidates) {
+				if(assigned[t]) continue;
+				candidates[kept++] = t;
+				Consider(t);
+			}
+			candidates.resize(kept);
+
+			//Pieces that share no vertices, like faces with their own normals, 
+			//continue with the nearest of the next few triangles in order.
+			if(next == ~0u) {
+				while(restart < triangles && assigned[restart]) restart++;
+				for(unsigned t = restart; t < std::min(triangles, restart + 64); t++) {
+					if(!assigned[t]) Consider(t);
+				}
+			}
+		}
+
+		meshlet.vertexCount = (unsigned)meshletVertices.size();
+		for(unsigned v : meshletVertices) {
+			vertices.push_back(mVertices[v]);
+			local[v] = ~0u;
+		}
+		meshletVertices.clear();
+
+		const Vertex* first = vertices.data() + meshlet.firstVertex;
+		vec3 min = first[0].xyz(), max = min;
+		for(unsigned i = 1; i < meshlet.vertexCount; i++) {
+			const Vertex& v = first[i];
+			min = { std::min(min.x, v.x()), std::min(min.y, v.y()), std::min(min.z, v.z()) };
+			max = { std::max(max.x, v.x()), std::max(max.y, v.y()), std::max(max.z, v.z()) };
+		}
+		meshlet.boundingBox = { min, max };
+		meshlet.boundingSphere = { (min + max) * .5f, 0.f };
+		for(unsigned i = 0; i < meshlet.vertexCount; i++) {
+			meshlet.boundingSphere.radius = std::max(meshlet.boundingSphere.radius, (first[i].xyz() - meshlet.boundingSphere.center).length());
+		}
+
+		//The cone holds every triangle normal, degenerate triangles have none.
+		std::vector<vec3> normals;
+		vec3 axis = { 0.f, 0.f, 0.f };
+		for(unsigned t = meshlet.firstTriangle; t < meshlet.firstTriangle + meshlet.triangleCount; t++) {
+			const vec3 a = vertices[faces[t][0]].xyz();
+			vec3 normal = cross(vertices[faces[t][1]].xyz() - a, vertices[faces[t][2]].xyz() - a);
+			float length = normal.length();
+			if(length == 0.f) continue;
+			normals.push_back(normal * (1.f / length));
+			axis += normals.back();
+		}
+		float axisLength = axis.length();
+		meshlet.coneAxis = axisLength > 0.f ? axis * (1.f / axisLength) : vec3(0.f, 0.f, 1.f);
+		float minDot = axisLength > 0.f ? 1.f : -1.f;
+		for(const vec3& normal : normals) minDot = std::min(minDot, dot(normal, meshlet.coneAxis));
+		//Slightly wider than the normals, for the rounding of the per triangle tests.
+		meshlet.coneCutoff = minDot > 0.f ? std::sqrt(1.f - minDot * minDot) + 1e-3f : 2.f;
+
+		meshlets.push_back(meshlet);
+	}
+
+	mVertices.swap(vertices);
+	mTriangles.swap(faces);
+	mMeshlets.swap(meshlets);
+	mVertexView = ArrayView<Vertex>(mVertices.data(), mVertices.size());
+	mTriangleView = ArrayView<uvec3>(mTriangles.data(), mTriangles.size());
+	mMeshletView = ArrayView<Meshlet>(mMeshlets.data(), mMeshlets.size());
+	buildStreams();
+	computeBounds();
+}
@@ -31,11 +31,69 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <string>
 #include <sstream>
 #include "vertex.hpp"
+#include "../Math/transform.hpp"
+#include "../System/mappedfile.hpp"
+
+class ThreadPool;
+
+//Read only elements, owned by a mesh or by the file it maps.
+template<class T>
+class ArrayView {
+
+	const T* mData = nullptr;
+	size_t mSize = 0;
+
+	public:
+
+		ArrayView() = default;
+		ArrayView(const T* data, size_t size) : mData(data), mSize(size) {}
+
+		inline const T* begin() const { return mData; }
+		inline const T* end() const { return mData + mSize; }
+
+		inline const T* data() const { return mData; }
+		inline size_t size() const { return mSize; }
+		inline bool empty() const { return mSize == 0; }
+
+		inline const T& operator[](size_t index) const { return mData[index]; }
+
+};
 
 class Mesh {
 
+	public:
+
+		//Nearby triangles with a range of vertices of their own, so that they can 
+		//be culled as a whole before any of their vertices are transformed.
+		struct Meshlet {
+			unsigned firstVertex, vertexCount;
+			unsigned firstTriangle, triangleCount;
+			BoundingSphere boundingSphere;
+			BoundingBox boundingBox;
+			vec3 coneAxis; //Average direction of the triangle normals
+			float coneCutoff; //Sine of the widest normal's angle from the axis, 1 or more when there's no cone
+		};
+
+	private:
+
 	std::vector<Vertex> mVertices; 
 	std::vector<uvec3> mTriangles; 
+	std::vector<Meshlet> mMeshlets;
+
+	//Positions and normals as structure of arrays, for the batched transforms.
+	std::vector<float> mPositionX, mPositionY, mPositionZ;
+	std::vector<float> mNormalX, mNormalY, mNormalZ;
+
+	MappedFile mFile; //Holds the arrays instead of the vectors when loaded from a binary mesh
+
+	//What the accessors read, either the vectors or the mapped file.
+	ArrayView<Vertex> mVertexView;
+	ArrayView<uvec3> mTriangleView;
+	ArrayView<Meshlet> mMeshletView;
+	SoAVec3 mPositionStreams = {}, mNormalStreams = {};
+
+	BoundingBox mBoundingBox = {};
+	BoundingSphere mBoundingSphere = {};
 
 	public:
 
@@ -43,33 +101,102 @@ class Mesh {
 		Mesh(const Mesh& b) = delete;
 
 		Mesh(Mesh&& b) {
-			std::swap(mVertices, b.mVertices);
-			std::swap(mTriangles, b.mTriangles);
+			swap(b);
 		}
 
 		Mesh& operator=(Mesh&& b) {
-			std::swap(mVertices, b.mVertices);
-			std::swap(mTriangles, b.mTriangles);
+			swap(b);
 			return *this;
 		}
 
 		~Mesh() {}
 		
-		bool load(const std::string& path);
+		//Reads an OBJ file or maps a binary mesh written by saveBinary, which is used 
+		//in place without copying. OBJ files are parsed in parallel chunks when given 
+		//a pool, the result is the same.
+		bool load(const std::string& path, ThreadPool* pool = nullptr);
 
-		inline const std::vector<Vertex>& vertices() const { return mVertices; }
+		//Writes the vertices, triangles, streams, bounds and meshlets as a binary mesh.
+		bool saveBinary(const std::string& path) const;
 
-		inline const std::vector<uvec3> triangles() const { return mTriangles; }
+		inline bool isMapped() const { return mFile.isOpen(); }
+
+		//Rebuilds the structure of arrays streams from the vertices.
+		void buildStreams();
+
+		inline const SoAVec3& positionStreams() const { return mPositionStreams; }
+
+		inline const SoAVec3& normalStreams() const { return mNormalStreams; }
+
+		//Recomputes the bounding box and the bounding sphere from the vertices.
+		void computeBounds();
+
+		//Average cache miss ratio, vertices transformed per triangle with a FIFO 
+		//cache of cacheSize vertices. Around 0.5 is ideal, 3 is the worst.
+		float acmr(unsigned cacheSize = 16) const;
+
+		struct Optimization {
+			float acmrBefore, acmrAfter;
+		};
+
+		//Reorders the triangles for vertex cache reuse, Forsyth style, and the vertices 
+		//in the order the triangles first use them. Mapped arrays are copied out first.
+		Optimization optimize();
+
+		//Partitions the triangles into meshlets, the vertices they share are duplicated. 
+		//Loading more of an OBJ file or optimizing the mesh drops the meshlets.
+		void buildMeshlets(unsigned maxVertices = 64, unsigned maxTriangles = 126);
+
+		inline const ArrayView<Meshlet>& meshlets() const { return mMeshletView; }
+
+		inline const BoundingBox& boundingBox() const { return mBoundingBox; }
+
+		inline const BoundingSphere& boundingSphere() const { return mBoundingSphere; }
+
+		inline const ArrayView<Vertex>& vertices() const { return mVertexView; }
+
+		inline const ArrayView<uvec3>& triangles() const { return mTriangleView; }
 
 		//Some functions, for convenience.
 
-		inline const Vertex& vertex(unsigned index) const { return mVertices[index]; }
+		inline const Vertex& vertex(unsigned index) const { return mVertexView[index]; }
+
+		inline unsigned vertexCount() const { return (unsigned)mVertexView.size(); }
+
+		inline const uvec3& triangle(unsigned index) const { return mTriangleView[index]; }
+
+		inline unsigned triangleCount() const { return (unsigned)mTriangleView.size(); }
+
+	private:
 
-		inline unsigned vertexCount() const { return mVertices.size(); }
+		bool loadObj(const MappedFile& file, ThreadPool* pool);
 
-		inline const uvec3& triangle(unsigned index) const { return mTriangles[index]; }
+		bool loadBinary(MappedFile& file);
 
-		inline unsigned triangleCount() const { return mTriangles.size(); }
+		void clearMeshlets();
+
+		//Copies mapped arrays into the vectors, so that they can be added to.
+		void ownArrays();
+
+		void swap(Mesh& b) {
+			std::swap(mVertices, b.mVertices);
+			std::swap(mTriangles, b.mTriangles);
+			std::swap(mMeshlets, b.mMeshlets);
+			std::swap(mPositionX, b.mPositionX);
+			std::swap(mPositionY, b.mPositionY);
+			std::swap(mPositionZ, b.mPositionZ);
+			std::swap(mNormalX, b.mNormalX);
+			std::swap(mNormalY, b.mNormalY);
+			std::swap(mNormalZ, b.mNormalZ);
+			mFile.swap(b.mFile);
+			std::swap(mVertexView, b.mVertexView);
+			std::swap(mTriangleView, b.mTriangleView);
+			std::swap(mMeshletView, b.mMeshletView);
+			std::swap(mPositionStreams, b.mPositionStreams);
+			std::swap(mNormalStreams, b.mNormalStreams);
+			std::swap(mBoundingBox, b.mBoundingBox);
+			std::swap(mBoundingSphere, b.mBoundingSphere);
+		}
 };
 
 #endif //MESH_HPP
@@ -28,87 +28,198 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <iostream>
 #include "edge.hpp"
 #include "gradients.hpp"
+#include "../System/threadpool.hpp"
+
+
+RenderContext::RenderContext() = default;
+
+RenderContext::RenderContext(Canvas& canvas): 
+	mCanvas(&canvas) 
+{
+	mWidth = mCanvas->width();
+	mHeight = mCanvas->height();
+	mScreenSpaceTransform = mat4::ScreenSpace((float)canvas.width() * .5f, (float)canvas.height() * .5f);
+	unsigned size = mWidth * mHeight * sizeof(float);
+	size += (size % 16);
+	mDepthBuffer = (float*)_aligned_malloc(size, 16);
+	resizeTiles();
+	resizeHiZ();
+}
 
-
+RenderContext::~RenderContext() {
+	if(mDepthBuffer) _aligned_free(mDepthBuffer);
+}
 
 void RenderContext::drawMesh(const Mesh& mesh, const mat4& transform, const Texture& texture, const mat4& normalMatrix) {
-	mTexture = &texture;
-
-	for(auto& face: mesh.triangles()) {
-		Vertex a, b, c;
-		a = mesh.vertices()[face[0]];
-		b = mesh.vertices()[face[1]];
-		c = mesh.vertices()[face[2]];
-		a.transform(transform, normalMatrix);
-		b.transform(transform, normalMatrix);
-		c.transform(transform, normalMatrix);
-
-		fillTriangle(a, b, c);
+	bindTexture(&texture);
+	drawTriangles(mesh, transform, normalMatrix);
+}
+
+void RenderContext::drawMesh(const Mesh& mesh, const mat4& transform, const mat4& normalMatrix) {
+	bindTexture(nullptr);
+	drawTriangles(mesh, transform, normalMatrix);
+}
+
+void RenderContext::drawTriangles(const Mesh& mesh, const mat4& transform, const mat4& normalMatrix) {
+
+	//Whole draws outside of the view volume are rejected before touching a single vertex.
+	Containment containment = ClassifyBounds(transform, mesh.boundingSphere(), mesh.boundingBox());
+	if(containment == Containment::Outside) {
+		mCulledDraws++;
+		return;
 	}
 
+	unsigned vertexCount = mesh.vertexCount();
+	if(mTransformedVertices.size() < vertexCount) {
+		mTransformedVertices.resize(vertexCount);
+		mScreenVertices.resize(vertexCount);
+		mOutCodes.resize(vertexCount);
+		mClipPositions.resize(vertexCount);
+		mScreenPositions.resize(vertexCount);
+		mTransformedNormals.resize(vertexCount);
+	}
+
+	if(mesh.meshlets().empty()) {
+		bool inside = containment == Containment::Inside;
+		transformVertices(mesh, 0, vertexCount, transform, normalMatrix, inside);
+		drawFaces(mesh, 0, mesh.triangleCount(), inside);
+		flush();
+		return;
+	}
+
+	//Meshlets off screen or facing away as a whole don't transform their vertices either.
+	vec4 eye = ClipSpaceEye(transform);
+	for(const Mesh::Meshlet& meshlet : mesh.meshlets()) {
+		Containment meshletContainment = containment == Containment::Inside ? Containment::Inside : ClassifyBounds(transform, meshlet.boundingSphere, meshlet.boundingBox);
+		if(meshletContainment == Containment::Outside || isCulled(meshlet, eye)) {
+			mCulledMeshlets++;
+			continue;
+		}
+		bool inside = meshletContainment == Containment::Inside;
+		transformVertices(mesh, meshlet.firstVertex, meshlet.vertexCount, transform, normalMatrix, inside);
+		drawFaces(mesh, meshlet.firstTriangle, meshlet.triangleCount, inside);
+	}
+
+	flush();
 }
 
-void RenderContext::drawMesh(const Mesh& mesh, const mat4& transform, const mat4& normalMatrix) {
-	mTexture = nullptr;
-
-	for(auto& face : mesh.triangles()) {
-		Vertex a, b, c;
-		a = mesh.vertices()[face[0]];
-		b = mesh.vertices()[face[1]];
-		c = mesh.vertices()[face[2]];
-		a.transform(transform, normalMatrix);
-		b.transform(transform, normalMatrix);
-		c.transform(transform, normalMatrix);
-
-		fillTriangle(a, b, c);
+//The point in model space that clip space x, y and w are all zero at, which is the camera. Every 
+//triangle's HomogeneousDeterminant is dot(normal, eye.xyz - point * eye.w) for a point on it.
+vec4 RenderContext::ClipSpaceEye(const mat4& transform) {
+	auto Row = [&](int r) { return vec4(transform.at(0, r), transform.at(1, r), transform.at(2, r), transform.at(3, r)); };
+	vec4 x = Row(0), y = Row(1), w = Row(3);
+	auto Det3 = [](float a0, float a1, float a2, float b0, float b1, float b2, float c0, float c1, float c2) {
+		return a0 * (b1 * c2 - b2 * c1) - a1 * (b0 * c2 - b2 * c0) + a2 * (b0 * c1 - b1 * c0);
+	};
+	return vec4(
+		Det3(x.y, x.z, x.w, y.y, y.z, y.w, w.y, w.z, w.w),
+		-Det3(x.x, x.z, x.w, y.x, y.z, y.w, w.x, w.z, w.w),
+		Det3(x.x, x.y, x.w, y.x, y.y, y.w, w.x, w.y, w.w),
+		-Det3(x.x, x.y, x.z, y.x, y.y, y.z, w.x, w.y, w.z)
+	);
+}
+
+bool RenderContext::isCulled(const Mesh::Meshlet& meshlet, const vec4& eye) const {
+	if(mCullMode == CullMode::None) return false;
+
+	//Scaled by eye.w, which also makes this work for orthographic 
+	//projections, where the eye is a direction instead.
+	float sign = eye.w < 0.f ? -1.f : 1.f;
+	float scale = eye.w * sign;
+	vec3 toCenter = meshlet.boundingSphere.center * scale - eye.xyz() * sign;
+	float radius = meshlet.boundingSphere.radius * scale;
+	float distance = toCenter.length();
+	float along = dot(toCenter, meshlet.coneAxis);
+
+	//The view direction to any point of the sphere is within 90 degrees minus the 
+	//cone's angle from the axis, so all the triangles face the same way.
+	float limit = meshlet.coneCutoff * (distance + radius) + radius;
+	float frontFacing = 0.f;
+	if(along > limit) frontFacing = -sign;
+	else if(-along > limit) frontFacing = sign;
+	return frontFacing != 0.f && isCulled(frontFacing);
+}
+
+//Every vertex of the range is transformed only once, no matter how many faces share it.
+void RenderContext::transformVertices(const Mesh& mesh, unsigned first, unsigned count, const mat4& transform, const mat4& normalMatrix, bool inside) {
+	auto Offset = [first](const SoAVec4Out& streams) { return SoAVec4Out{ streams.x + first, streams.y + first, streams.z + first, streams.w + first }; };
+	SoAVec4Out clip = Offset(mClipPositions.streams());
+	SoAVec4Out screen = Offset(mScreenPositions.streams());
+	SoAVec4Out normals = Offset(mTransformedNormals.streams());
+
+	const SoAVec3& positionStreams = mesh.positionStreams();
+	const SoAVec3& normalStreams = mesh.normalStreams();
+	SoAVec3 positions = { positionStreams.x + first, positionStreams.y + first, positionStreams.z + first };
+	SoAVec3 directions = { normalStreams.x + first, normalStreams.y + first, normalStreams.z + first };
+
+	TransformPoints(transform, positions, count, clip, inside ? nullptr : mOutCodes.data() + first, &mScreenSpaceTransform, &screen);
+	TransformDirections(normalMatrix, directions, count, normals);
+
+	for(unsigned i = 0; i < count; i++) {
+		const Vertex& vertex = mesh.vertex(first + i);
+		vec3 normal = { normals.x[i], normals.y[i], normals.z[i] };
+		mTransformedVertices[first + i] = Vertex({ clip.x[i], clip.y[i], clip.z[i], clip.w[i] }, vertex.color(), vertex.texCoord(), normal);
+		mScreenVertices[first + i] = Vertex({ screen.x[i], screen.y[i], screen.z[i], screen.w[i] }, vertex.color(), vertex.texCoord(), normal);
+	}
+}
+
+void RenderContext::drawFaces(const Mesh& mesh, unsigned first, unsigned count, bool inside) {
+	const uvec3* faces = mesh.triangles().data() + first;
+
+	//Nothing fully inside the view volume needs clipping.
+	if(inside) {
+		for(unsigned i = 0; i < count; i++) {
+			const uvec3& face = faces[i];
+			const Vertex& a = mTransformedVertices[face[0]];
+			const Vertex& b = mTransformedVertices[face[1]];
+			const Vertex& c = mTransformedVertices[face[2]];
+			if(isCulled(HomogeneousDeterminant(a, b, c))) {
+				mCulledTriangles++;
+				continue;
+			}
+			setupTriangle(mScreenVertices[face[0]], mScreenVertices[face[1]], mScreenVertices[face[2]]);
+		}
+		return;
 	}
 
+	for(unsigned i = 0; i < count; i++) {
+		const uvec3& face = faces[i];
+		fillTriangle(
+			mTransformedVertices[face[0]], mTransformedVertices[face[1]], mTransformedVertices[face[2]], 
+			&mScreenVertices[face[0]], &mScreenVertices[face[1]], &mScreenVertices[face[2]], 
+			mOutCodes[face[0]], mOutCodes[face[1]], mOutCodes[face[2]]
+		);
+	}
 }
 
 void RenderContext::fillTriangle(const Vertex& a, const Vertex& b, const Vertex& c) {
+	fillTriangle(a, b, c, nullptr, nullptr, nullptr, Clipper::OutCode(a), Clipper::OutCode(b), Clipper::OutCode(c));
+}
 
-	auto clipTriangle = [](const Vertex& a, const Vertex& b, const Vertex& c, std::vector<Vertex>& output) -> bool {
-
-		std::vector<Vertex> tmp1{ a, b, c }, tmp2;
-		auto ping = &tmp1, pong = &tmp2;
+void RenderContext::setupTriangle(const Vertex& a, const Vertex& b, const Vertex& c) {
 
-		for(int i = 0; i < 3; i++) {
-			for(float j = -1.f; j <= 1.f; j += 2.f) {
+	const Vertex* minYV = &a, *midYV = &b, *maxYV = &c;
 
-				const Vertex* prev = &ping->back();
-				float prevCmpVal = prev->xyzwComponent(i) * j;
-				bool prevInside = prevCmpVal <= prev->w();
+	//Screen space y points down, so the winding is reversed here.
+	if(isCulled(TriangleAreaDoubled(*minYV, *maxYV, *midYV))) return;
 
-				for(int k = 0; k < ping->size(); k++) {
-					const Vertex* curr = &ping->at(k);
+	if(maxYV->y() < midYV->y()) std::swap(maxYV, midYV);
+	if(midYV->y() < minYV->y()) std::swap(midYV, minYV);
+	if(maxYV->y() < midYV->y()) std::swap(maxYV, midYV);
 
-					float currCmpVal = curr->xyzwComponent(i) * j;
-					bool currInside = currCmpVal <= curr->w();
+	bool handedness = TriangleAreaDoubled(*minYV, *maxYV, *midYV) >= 0.0;
 
-					if(currInside != prevInside) {
-						float mixAmt = (prev->w() - prevCmpVal) / ((prev->w() - prevCmpVal) - (curr->w() - currCmpVal));
-						pong->emplace_back(Vertex::Mix(*prev, *curr, mixAmt));
-					}
+	if(mTiledRendering) {
+		binTriangle(*minYV, *midYV, *maxYV, handedness);
+	} else {
+		rasterizeTriangle(*minYV, *midYV, *maxYV, handedness, mTexture, canvasRect());
+	}
 
-					if(currInside) {
-						pong->emplace_back(*curr);
-					}
+	mDrawnTriangles++;
+}
 
-					prev = curr;
-					prevCmpVal = currCmpVal;
-					prevInside = currInside;
+void RenderContext::fillTriangle(const Vertex& a, const Vertex& b, const Vertex& c, const Vertex* screenA, const Vertex* screenB, const Vertex* screenC, unsigned codeA, unsigned codeB, unsigned codeC) {
 
-				}
-				ping->clear();
-				if(pong->empty()) return false;
-				std::swap(ping, pong);
-			}
-		}
-		if(ping->empty()) return false;
-		output = tmp1;
-		return true;
-	};
-	
 	auto fill = [this](const Vertex& a, const Vertex& b, const Vertex& c) {
 
 		Vertex tra = a;
@@ -119,150 +230,540 @@ void RenderContext::fillTriangle(const Vertex& a, const Vertex& b, const Vertex&
 		trb.transform(mScreenSpaceTransform).perspectiveDivide();
 		trc.transform(mScreenSpaceTransform).perspectiveDivide();
 
-		Vertex* minYV = &tra, *midYV = &trb, *maxYV = &trc;
+		setupTriangle(tra, trb, trc);
+	};
 
-		if(TriangleAreaDoubled(*minYV, *maxYV, *midYV) <= 0.0) return;
+	//Unclipped triangles can use the screen space vertices from the vertex cache.
+	auto fillUnclipped = [&]() {
+		if(screenA) {
+			setupTriangle(*screenA, *screenB, *screenC);
+		} else {
+			fill(a, b, c);
+		}
+	};
 
-		if(maxYV->y() < midYV->y()) std::swap(maxYV, midYV);
-		if(midYV->y() < minYV->y()) std::swap(midYV, minYV);
-		if(maxYV->y() < midYV->y()) std::swap(maxYV, midYV);
+	if(codeA & codeB & codeC) {
+		mClipper.countTrivialReject();
+		return;
+	}
 
-		bool handedness = TriangleAreaDoubled(*minYV, *maxYV, *midYV) >= 0.0;
+	//Facing is decided in clip space, so culled triangles are never clipped or projected.
+	if(isCulled(HomogeneousDeterminant(a, b, c))) {
+		mCulledTriangles++;
+		return;
+	}
 
-		scanTriangle(*minYV, *midYV, *maxYV, handedness);
+	if(!(codeA | codeB | codeC)) {
+		mClipper.countTrivialAccept();
+		fillUnclipped();
+		return;
+	}
 
-		mDrawnTriangles++;
+	//Crossing the side planes is fine as long as the triangle stays inside the 
+	//guard band, the rasterizers scissor it to the canvas. Near and far planes 
+	//are always clipped, so w stays positive for the perspective divide.
+	unsigned planes = (codeA | codeB | codeC) & (Clipper::Near | Clipper::Far);
+	planes |= Clipper::GuardBandOutCode(a, mGuardBand) | Clipper::GuardBandOutCode(b, mGuardBand) | Clipper::GuardBandOutCode(c, mGuardBand);
 
-	};
+	if(!planes) {
+		mClipper.countGuardBandAccept();
+		fillUnclipped();
+		return;
+	}
+
+	if(mClipper.clip(a, b, c, planes, mGuardBand)) {
+		const Vertex* vertices = mClipper.vertices();
+		for(int i = 1; i < mClipper.vertexCount()-1; i++) {
+			fill(vertices[0], vertices[i], vertices[i+1]);
+		}
+	}
+
+}
 
-	if(a.isInView() && b.isInView() && c.isInView()) {
-		fill(a, b, c);
+void RenderContext::enableTiledRendering(bool tiled, unsigned threads) {
+	flush();
+	mTiledRendering = tiled;
+	if(!tiled) {
+		mThreadPool.reset();
 		return;
 	}
+	if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+	//The thread calling flush() works on the tiles too, alone when there's no pool.
+	if(threads == 1) mThreadPool.reset();
+	else if(!mThreadPool || mThreadPool->threadCount() != threads - 1) {
+		mThreadPool.reset(new ThreadPool(threads - 1));
+	}
+}
 
-	std::vector<Vertex> vertices{};
+void RenderContext::setTileSize(int size) {
+	flush();
+	//Tiles have to consist of whole hierarchical depth blocks, so one thread owns each block.
+	mTileSize = std::max(8, size & ~((1 << HiZBlockShift) - 1));
+	resizeTiles();
+}
 
-	if(clipTriangle(a, b, c, vertices)) {
-		for(int i = 1; i < (int)vertices.size()-1; i++) {
-			fill(vertices[0], vertices[i], vertices[i+1]);
+void RenderContext::resizeTiles() {
+	mTilesX = (mWidth + mTileSize - 1) / mTileSize;
+	mTilesY = (mHeight + mTileSize - 1) / mTileSize;
+	mTileBins.clear();
+	mTileBins.resize(mTilesX * mTilesY);
+}
+
+void RenderContext::resizeHiZ() {
+	mHiZWidth = (mWidth + (1 << HiZBlockShift) - 1) >> HiZBlockShift;
+	mHiZHeight = (mHeight + (1 << HiZBlockShift) - 1) >> HiZBlockShift;
+	mHiZ.assign(mHiZWidth * mHiZHeight * 2, 1.0f);
+	//Depth buffer content is unknown until it's cleared.
+	mHiZDirty.assign(mHiZWidth * mHiZHeight * 2, 1);
+}
+
+float RenderContext::hiZMaxDepth(int blockX, int blockY) {
+	int field = hiZField();
+	int index = ((blockX + blockY * mHiZWidth) << 1) + field;
+	if(mHiZDirty[index]) {
+		int x0 = blockX << HiZBlockShift;
+		int y0 = blockY << HiZBlockShift;
+		int x1 = std::min(mWidth, x0 + (1 << HiZBlockShift));
+		int y1 = std::min(mHeight, y0 + (1 << HiZBlockShift));
+		float maxDepth = -1.0f;
+		for(int y = y0; y < y1; y++) {
+			const float* row = mDepthBuffer + y * mWidth;
+			for(int x = x0 + ((x0 ^ y ^ field) & 1); x < x1; x += 2) {
+				maxDepth = std::max(maxDepth, row[x]);
+			}
 		}
+		mHiZ[index] = maxDepth;
+		mHiZDirty[index] = 0;
 	}
+	return mHiZ[index];
+}
 
+bool RenderContext::isOccluded(const ScissorRect& rect, float minDepth) {
+	if(!mHierarchicalZ) return false;
+	int bx0 = rect.minX >> HiZBlockShift, bx1 = (rect.maxX - 1) >> HiZBlockShift;
+	int by0 = rect.minY >> HiZBlockShift, by1 = (rect.maxY - 1) >> HiZBlockShift;
+	for(int by = by0; by <= by1; by++) {
+		for(int bx = bx0; bx <= bx1; bx++) {
+			if(minDepth < hiZMaxDepth(bx, by)) return false;
+		}
+	}
+	return true;
 }
 
-void RenderContext::scanTriangle(const Vertex& a, const Vertex& b, const Vertex& c, bool handedness) {
-	
-	Gradients gradients(mPerspectiveCorrected, a, b, c);
-	Edge topBottom(gradients, a, c, 0);
-	Edge topMiddle(gradients, a, b, 0);
-	Edge middleBottom(gradients, b, c, 1);
+void RenderContext::binTriangle(const Vertex& minYV, const Vertex& midYV, const Vertex& maxYV, bool handedness) {
+	unsigned index = (unsigned)mBinnedTriangles.size();
+	mBinnedTriangles.push_back({ minYV, midYV, maxYV, handedness, mTexture });
+
+	//Bounds are padded by a pixel, so rounding in the edge stepping 
+	//can't put pixels into a tile which doesn't have the triangle.
+	float minX = std::min(minYV.x(), std::min(midYV.x(), maxYV.x()));
+	float maxX = std::max(minYV.x(), std::max(midYV.x(), maxYV.x()));
+	int x0 = Clamp((int)ceilf(minX) - 1, 0, mWidth - 1);
+	int x1 = Clamp((int)ceilf(maxX) + 1, 0, mWidth - 1);
+	int y0 = Clamp((int)ceilf(minYV.y()) - 1, 0, mHeight - 1);
+	int y1 = Clamp((int)ceilf(maxYV.y()) + 1, 0, mHeight - 1);
+
+	for(int ty = y0 / mTileSize; ty <= y1 / mTileSize; ty++) {
+		for(int tx = x0 / mTileSize; tx <= x1 / mTileSize; tx++) {
+			mTileBins[tx + ty * mTilesX].push_back(index);
+		}
+	}
+}
 
-	scanEdge(gradients, &topBottom, &topMiddle, handedness);
-	scanEdge(gradients, &topBottom, &middleBottom, handedness);
-		
+void RenderContext::flush() {
+	if(mBinnedTriangles.empty()) return;
+
+	//Each tile is owned by a single thread and it goes through its triangles 
+	//in submission order, so the depth test gives the same result as serially.
+	auto rasterizeTile = [this](int tile) {
+		std::vector<unsigned>& bin = mTileBins[tile];
+		int tx = tile % mTilesX;
+		int ty = tile / mTilesX;
+		ScissorRect scissor = {
+			tx * mTileSize, 
+			ty * mTileSize, 
+			std::min(mWidth, (tx + 1) * mTileSize), 
+			std::min(mHeight, (ty + 1) * mTileSize) 
+		};
+		for(unsigned index : bin) {
+			const BinnedTriangle& tri = mBinnedTriangles[index];
+			rasterizeTriangle(tri.minYV, tri.midYV, tri.maxYV, tri.handedness, tri.texture, scissor);
+		}
+		bin.clear();
+	};
+	if(mThreadPool) mThreadPool->parallelFor(mTilesX * mTilesY, rasterizeTile);
+	else for(int tile = 0; tile < mTilesX * mTilesY; tile++) rasterizeTile(tile);
+
+	mBinnedTriangles.clear();
 }
 
-void RenderContext::drawScanLineTextured(const Gradients& gradients, Edge* a, Edge* b, int y) {
-	int xMin = (int)ceilf(a->x());
-	int xMax = (int)ceilf(b->x());
+unsigned RenderContext::kernelState(const BoundTexture& texture) const {
+	unsigned state = 0;
+	if(texture.texture) state |= KernelTextured;
+	if(mEnableLighting) state |= KernelLit;
+	if(mCheckerBoard & 1) state |= KernelCheckerOdd;
+	if(mPerspectiveCorrected) state |= KernelPerspective;
+	return state;
+}
 
-	float offset = xMin - a->x();
-	float depth = a->depth() + gradients.depthXStep() * offset;
-	float zDivisor = a->zDivisor() + gradients.zDivisorXStep() * offset;
+template<>
+void RenderContext::FillKernels<0>(RasterKernels*) {}
 
-	vec4 color = a->color() + gradients.colorXStep() * offset;
-	vec3 normal = a->normal() + gradients.normalXStep() * offset;
-	vec2 texCoord = a->texCoord() + gradients.texCoordXStep() * offset;
+template<unsigned Count>
+void RenderContext::FillKernels(RasterKernels* kernels) {
+	const unsigned State = Count - 1;
+	kernels[State].scanLine = &RenderContext::drawScanLine<State>;
+	kernels[State].halfSpace = &RenderContext::rasterizeHalfSpace<State>;
+	FillKernels<State>(kernels);
+}
 
-	vec3 sunPos = vec3(mSunPosition).normalized();
+const RenderContext::RasterKernels& RenderContext::Kernels(unsigned state) {
+	static const std::vector<RasterKernels> kernels = []() {
+		std::vector<RasterKernels> table(KernelStateCount);
+		FillKernels<KernelStateCount>(table.data());
+		return table;
+	}();
+	return kernels[state];
+}
 
-	float mipLevels = (float)mTexture->mipLevels()-1.f;
+template<unsigned State>
+inline float RenderContext::TextureLod(const Texture* texture, const Gradients& gradients, const vec2& uv, float z) {
+	vec2 dx = gradients.texCoordXStep();
+	vec2 dy = gradients.texCoordYStep();
 
+	//The interpolated texture coordinates are divided by w, so their 
+	//screen space derivatives follow from the quotient rule.
+	if(State & KernelPerspective) {
+		dx = (dx - uv * gradients.zDivisorXStep()) * z;
+		dy = (dy - uv * gradients.zDivisorYStep()) * z;
+	}
 
-	for(int x = xMin; x < xMax; x++) {
+	float width = (float)texture->width();
+	float height = (float)texture->height();
+	float lengthX = dx.x * dx.x * width * width + dx.y * dx.y * height * height;
+	float lengthY = dy.x * dy.x * width * width + dy.y * dy.y * height * height;
 
+	//Texels per pixel along the longer axis, log2 of the squared length halved.
+	return Clamp(.5f * FastLog2(std::max(std::max(lengthX, lengthY), 1e-12f)), 0.f, (float)texture->mipLevels());
+}
 
-		if((x & 1) ^ (y & 1) ^ (mCheckerBoard&1)) {
+template<unsigned State>
+inline vec4 RenderContext::shade(const vec4& texel, const vec4& color, const vec3& normal, float depth, float z) const {
+	vec4 sun = (State & KernelLit) ? mix(mAmbientColor, mSunColor, std::min(1.f, std::max(mAmbientIntensity, dot(normal*z, mSunDirection)*mSunIntensity))) : 1.f;
+	float zd = (1.0f - (depth / z));
+	if(State & KernelTextured) {
+		zd = Clamp(zd*zd*zd, 0.f, 1.f);
+		return (texel * (color * z) * sun)*(1.0f - zd) + mAmbientColor*mAmbientIntensity*zd;
+	}
+	zd = Clamp(zd*zd*zd, 0.f, 1.f);
+	return (((color * z) * sun) * (color * z) * sun)*(1.0f - zd) + mAmbientColor * mAmbientIntensity*zd;
+}
 
-			float z = 1.0f / zDivisor;
-			float& db = mDepthBuffer[x + y * mWidth];
+template<unsigned State>
+inline void RenderContext::queuePixel(PixelBatch& batch, const BoundTexture& texture, const Gradients& gradients, int x, int y, const vec4& color, const vec2& texCoord, const vec3& normal, float depth, float z) {
+	if(!(State & KernelTextured)) {
+		mCanvas->set(x, y, shade<State>(vec4(), color, normal, depth, z));
+		return;
+	}
+	int i = batch.count;
+	vec2 uv = texCoord * z;
+	batch.u[i] = uv.x;
+	batch.v[i] = uv.y;
+	batch.mipLevel[i] = TextureLod<State>(texture.texture, gradients, uv, z);
+	batch.x[i] = x;
+	batch.y[i] = y;
+	batch.color[i] = color;
+	batch.normal[i] = normal;
+	batch.depth[i] = depth;
+	batch.z[i] = z;
+	if(++batch.count == Texture::BatchWidth) flushPixels<State>(batch, texture);
+}
 
-			if(depth < db) {
-				vec4 sun = mEnableLighting ? mix(mAmbientColor, mSunColor, std::min(1.f, std::max(mAmbientIntensity, dot(normal*z, sunPos)*mSunIntensity))) : 1.f;
-				float zd = (1.0f - (depth / z));
-				float mipLevel = (std::min(1.f, std::max(0.f, zd*zd*zd)) * mipLevels);
-				zd = Clamp(zd*zd*zd, 0.f, 1.f);
-				mCanvas->set(x, y, (mTexture->sample(texCoord * z, mipLevel, mSamplingMode, mWrapingMode) * (color * z) * sun)*(1.0f - zd) + mAmbientColor*mAmbientIntensity*zd);
-				db = depth;
+template<unsigned State>
+void RenderContext::flushPixels(PixelBatch& batch, const BoundTexture& texture) {
+	if(!batch.count) return;
+
+	//Unused lanes repeat the first pixel, their results are dropped.
+	for(int i = batch.count; i < Texture::BatchWidth; i++) {
+		batch.u[i] = batch.u[0];
+		batch.v[i] = batch.v[0];
+		batch.mipLevel[i] = batch.mipLevel[0];
+	}
+
+	//The finest level wanted is reported before the texture clamps it to what's resident.
+	float finest = batch.mipLevel[0];
+	for(int i = 1; i < batch.count; i++) finest = std::min(finest, batch.mipLevel[i]);
+	texture.texture->requestLevel((int)finest);
+
+	vec4 texels[Texture::BatchWidth];
+	(texture.texture->*texture.sampleBatch)(batch.u, batch.v, batch.mipLevel, texels);
+	for(int i = 0; i < batch.count; i++) {
+		mCanvas->set(batch.x[i], batch.y[i], shade<State>(texels[i], batch.color[i], batch.normal[i], batch.depth[i], batch.z[i]));
+	}
+	batch.count = 0;
+}
+
+template<unsigned State>
+void RenderContext::rasterizeHalfSpace(const Vertex& a, const Vertex& b, const Vertex& c, const BoundTexture& texture, const ScissorRect& scissor) {
+
+	const Vertex* v0 = &a, *v1 = &b, *v2 = &c;
+	if(TriangleAreaDoubled(*v0, *v1, *v2) < 0.f) std::swap(v1, v2);
+
+	Gradients gradients(mPerspectiveCorrected, *v0, *v1, *v2);
+
+	//Edge function E(x, y) = A*x + B*y + C, positive inside the triangle. 
+	//Pixels exactly on an edge are drawn only for top and left edges, 
+	//which is the same fill convention the scanline rasterizer has.
+	struct EdgeFunction {
+		__m128 a, b, c;
+		__m128 inclusive;
+		EdgeFunction(const Vertex& p, const Vertex& q) {
+			float ea = -(q.y() - p.y());
+			float eb = q.x() - p.x();
+			a = _mm_set1_ps(ea);
+			b = _mm_set1_ps(eb);
+			c = _mm_set1_ps(-(ea * p.x() + eb * p.y()));
+			inclusive = _mm_castsi128_ps(_mm_set1_epi32((ea > 0.f || (ea == 0.f && eb > 0.f)) ? -1 : 0));
+		}
+		inline __m128 inside(__m128 x, __m128 y) const {
+			__m128 e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, x), _mm_mul_ps(b, y)), c);
+			__m128 zero = _mm_setzero_ps();
+			return _mm_or_ps(_mm_cmpgt_ps(e, zero), _mm_and_ps(_mm_cmpeq_ps(e, zero), inclusive));
+		}
+	};
+
+	EdgeFunction e0(*v1, *v2), e1(*v2, *v0), e2(*v0, *v1);
+
+	float minX = std::min(v0->x(), std::min(v1->x(), v2->x()));
+	float maxX = std::max(v0->x(), std::max(v1->x(), v2->x()));
+	float minY = std::min(v0->y(), std::min(v1->y(), v2->y()));
+	float maxY = std::max(v0->y(), std::max(v1->y(), v2->y()));
+
+	//Quads start from even coordinates, so the checkerboard pattern is the same for every quad.
+	int x0 = std::max(scissor.minX, (int)ceilf(minX)) & ~1;
+	int y0 = std::max(scissor.minY, (int)ceilf(minY)) & ~1;
+	int x1 = std::min(scissor.maxX, (int)FastFloor(maxX) + 1);
+	int y1 = std::min(scissor.maxY, (int)FastFloor(maxY) + 1);
+
+	//Lanes: 0 = (x, y), 1 = (x+1, y), 2 = (x, y+1), 3 = (x+1, y+1)
+	const __m128 laneX = _mm_set_ps(1.f, 0.f, 1.f, 0.f);
+	const __m128 laneY = _mm_set_ps(1.f, 1.f, 0.f, 0.f);
+	const int checkerMask = (State & KernelCheckerOdd) ? 0x9 : 0x6;
+
+	const __m128 scissorMinX = _mm_set1_ps((float)scissor.minX), scissorMaxX = _mm_set1_ps((float)scissor.maxX);
+	const __m128 scissorMinY = _mm_set1_ps((float)scissor.minY), scissorMaxY = _mm_set1_ps((float)scissor.maxY);
+
+	const __m128 originX = _mm_set1_ps(v0->x()), originY = _mm_set1_ps(v0->y());
+	const __m128 depth0 = _mm_set1_ps(gradients.depth(0));
+	const __m128 depthXStep = _mm_set1_ps(gradients.depthXStep()), depthYStep = _mm_set1_ps(gradients.depthYStep());
+	const __m128 zDivisor0 = _mm_set1_ps(gradients.zDivisor(0));
+	const __m128 zDivisorXStep = _mm_set1_ps(gradients.zDivisorXStep()), zDivisorYStep = _mm_set1_ps(gradients.zDivisorYStep());
+
+
+	alignas(16) float laneDepth[4], laneZ[4], laneDX[4], laneDY[4], laneDb[4];
+	PixelBatch batch;
+
+	float minDepth = std::min(v0->z(), std::min(v1->z(), v2->z()));
+
+	for(int y = y0; y < y1; y += 2) {
+		__m128 py = _mm_add_ps(_mm_set1_ps((float)y), laneY);
+		__m128 inY = _mm_and_ps(_mm_cmpge_ps(py, scissorMinY), _mm_cmplt_ps(py, scissorMaxY));
+
+		for(int x = x0; x < x1; x += 2) {
+			__m128 px = _mm_add_ps(_mm_set1_ps((float)x), laneX);
+
+			//Quads never straddle depth blocks, as both start from even coordinates.
+			if(isBlockOccluded(x, y, minDepth)) continue;
+
+			__m128 coverage = _mm_and_ps(_mm_and_ps(e0.inside(px, py), e1.inside(px, py)), e2.inside(px, py));
+			int mask = _mm_movemask_ps(coverage) & checkerMask;
+			if(!mask) continue;
+
+			__m128 inBounds = _mm_and_ps(inY, _mm_and_ps(_mm_cmpge_ps(px, scissorMinX), _mm_cmplt_ps(px, scissorMaxX)));
+			int boundsMask = _mm_movemask_ps(inBounds);
+			mask &= boundsMask;
+			if(!mask) continue;
+
+			//Interpolants are evaluated from the plane equations of the triangle, 
+			//so the result doesn't depend on where the rasterization started.
+			__m128 dx = _mm_sub_ps(px, originX);
+			__m128 dy = _mm_sub_ps(py, originY);
+			__m128 depth = _mm_add_ps(depth0, _mm_add_ps(_mm_mul_ps(depthXStep, dx), _mm_mul_ps(depthYStep, dy)));
+			__m128 zDivisor = _mm_add_ps(zDivisor0, _mm_add_ps(_mm_mul_ps(zDivisorXStep, dx), _mm_mul_ps(zDivisorYStep, dy)));
+
+			float* row0 = mDepthBuffer + x + y * mWidth;
+			float* row1 = row0 + mWidth;
+			__m128 db;
+			if(boundsMask == 0xF) {
+				db = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)row0), (const __m64*)row1);
+			} else {
+				laneDb[0] = (boundsMask & 1) ? row0[0] : 0.f;
+				laneDb[1] = (boundsMask & 2) ? row0[1] : 0.f;
+				laneDb[2] = (boundsMask & 4) ? row1[0] : 0.f;
+				laneDb[3] = (boundsMask & 8) ? row1[1] : 0.f;
+				db = _mm_load_ps(laneDb);
+			}
+
+			mask &= _mm_movemask_ps(_mm_cmplt_ps(depth, db));
+			if(!mask) continue;
+
+			__m128 write = _mm_castsi128_ps(_mm_set_epi32((mask & 8) ? -1 : 0, (mask & 4) ? -1 : 0, (mask & 2) ? -1 : 0, (mask & 1) ? -1 : 0));
+			__m128 newDb = _mm_or_ps(_mm_and_ps(write, depth), _mm_andnot_ps(write, db));
+			if(boundsMask == 0xF) {
+				_mm_storel_pi((__m64*)row0, newDb);
+				_mm_storeh_pi((__m64*)row1, newDb);
+			} else {
+				_mm_store_ps(laneDb, newDb);
+				if(boundsMask & 1) row0[0] = laneDb[0];
+				if(boundsMask & 2) row0[1] = laneDb[1];
+				if(boundsMask & 4) row1[0] = laneDb[2];
+				if(boundsMask & 8) row1[1] = laneDb[3];
+			}
+			markHiZDirty(x, y);
+
+			_mm_store_ps(laneDepth, depth);
+			_mm_store_ps(laneZ, (State & KernelPerspective) ? _mm_div_ps(_mm_set1_ps(1.f), zDivisor) : _mm_set1_ps(1.f));
+			_mm_store_ps(laneDX, dx);
+			_mm_store_ps(laneDY, dy);
+
+			for(int lane = 0; lane < 4; lane++) {
+				if(!(mask & (1 << lane))) continue;
+				int sx = x + (lane & 1);
+				int sy = y + (lane >> 1);
+				float ldx = laneDX[lane], ldy = laneDY[lane];
+				vec4 color = gradients.color(0) + gradients.colorXStep() * ldx + gradients.colorYStep() * ldy;
+				vec3 normal = gradients.normal(0) + gradients.normalXStep() * ldx + gradients.normalYStep() * ldy;
+				vec2 texCoord = (State & KernelTextured) ? gradients.texCoord(0) + gradients.texCoordXStep() * ldx + gradients.texCoordYStep() * ldy : vec2();
+				queuePixel<State>(batch, texture, gradients, sx, sy, color, texCoord, normal, laneDepth[lane], laneZ[lane]);
 			}
 		}
+	}
+	flushPixels<State>(batch, texture);
+}
 
-		color += gradients.colorXStep();
-		texCoord += gradients.texCoordXStep();
-		zDivisor += gradients.zDivisorXStep();
-		depth += gradients.depthXStep();
-		normal += gradients.normalXStep();
+void RenderContext::rasterizeTriangle(const Vertex& minYV, const Vertex& midYV, const Vertex& maxYV, bool handedness, const BoundTexture& texture, const ScissorRect& scissor) {
+	if(mHierarchicalZ) {
+		float minX = std::min(minYV.x(), std::min(midYV.x(), maxYV.x()));
+		float maxX = std::max(minYV.x(), std::max(midYV.x(), maxYV.x()));
+		ScissorRect bounds = {
+			std::max(scissor.minX, (int)ceilf(minX) - 1),
+			std::max(scissor.minY, (int)ceilf(minYV.y()) - 1),
+			std::min(scissor.maxX, (int)ceilf(maxX) + 1),
+			std::min(scissor.maxY, (int)ceilf(maxYV.y()) + 1)
+		};
+		if(bounds.minX >= bounds.maxX || bounds.minY >= bounds.maxY) return;
+		float minDepth = std::min(minYV.z(), std::min(midYV.z(), maxYV.z()));
+		if(isOccluded(bounds, minDepth - HiZDepthBias)) return;
 	}
+
+	const RasterKernels& kernels = Kernels(kernelState(texture));
+
+	switch(mRasterizer) {
+		case Rasterizer::Scanline: scanTriangle(minYV, midYV, maxYV, handedness, texture, scissor, kernels.scanLine); break;
+		case Rasterizer::HalfSpace: (this->*kernels.halfSpace)(minYV, midYV, maxYV, texture, scissor); break;
+	}
+}
+
+void RenderContext::scanTriangle(const Vertex& a, const Vertex& b, const Vertex& c, bool handedness, const BoundTexture& texture, const ScissorRect& scissor, ScanLineKernel kernel) {
+	
+	Gradients gradients(mPerspectiveCorrected, a, b, c);
+	Edge topBottom(gradients, a, c, 0);
+	Edge topMiddle(gradients, a, b, 0);
+	Edge middleBottom(gradients, b, c, 1);
+
+	scanEdge(gradients, texture, &topBottom, &topMiddle, handedness, scissor, kernel);
+	scanEdge(gradients, texture, &topBottom, &middleBottom, handedness, scissor, kernel);
+		
 }
 
-void RenderContext::drawScanLine(const Gradients& gradients, Edge* a, Edge* b, int y) {
+template<unsigned State>
+void RenderContext::drawScanLine(const Gradients& gradients, const BoundTexture& texture, Edge* a, Edge* b, int y, const ScissorRect& scissor) {
+	const bool textured = (State & KernelTextured) != 0;
+	const bool perspective = (State & KernelPerspective) != 0;
+	const int checker = (State & KernelCheckerOdd) ? 1 : 0;
+
 	int xMin = (int)ceilf(a->x());
 	int xMax = (int)ceilf(b->x());
 
-	float offset = xMin - a->x();
+	//Guard band triangles can begin left from the canvas, the interpolants 
+	//are computed right at the canvas edge instead of stepping there.
+	int xFirst = std::max(xMin, 0);
+	float offset = xFirst - a->x();
 	float depth = a->depth() + gradients.depthXStep() * offset;
 	float zDivisor = a->zDivisor() + gradients.zDivisorXStep() * offset;
 
-
-
 	vec4 color = a->color() + gradients.colorXStep() * offset;
 	vec3 normal = a->normal() + gradients.normalXStep() * offset;
+	vec2 texCoord = textured ? a->texCoord() + gradients.texCoordXStep() * offset : vec2();
 
-	vec3 sunPos = vec3(mSunPosition).normalized();
+	auto step = [&]() {
+		color += gradients.colorXStep();
+		if(textured) texCoord += gradients.texCoordXStep();
+		if(perspective) zDivisor += gradients.zDivisorXStep();
+		depth += gradients.depthXStep();
+		normal += gradients.normalXStep();
+	};
 
-	for(int x = xMin; x < xMax; x++) {
-		
-		if((x & 1) ^ (y & 1) ^ (mCheckerBoard & 1)) {
-			float z = 1.0f / zDivisor;
+	//Interpolants are stepped through the scissored pixels too, so 
+	//the values match exactly no matter how the span gets split.
+	int xStart = std::max(xFirst, scissor.minX);
+	int xEnd = std::min(xMax, scissor.maxX);
+	for(int x = xFirst; x < xStart; x++) step();
+
+	//Textured pixels along the span are sampled Texture::BatchWidth at the time.
+	PixelBatch batch;
+
+	//The span is walked one depth block at the time, occluded parts are only stepped over.
+	for(int blockStart = xStart; blockStart < xEnd;) {
+		int blockEnd = std::min(xEnd, (blockStart | ((1 << HiZBlockShift) - 1)) + 1);
+		float lastDepth = depth + gradients.depthXStep() * (float)(blockEnd - blockStart - 1);
+
+		if(isBlockOccluded(blockStart, y, std::min(depth, lastDepth))) {
+			for(int x = blockStart; x < blockEnd; x++) step();
+			blockStart = blockEnd;
+			continue;
+		}
+
+		//Only every other pixel belongs to this frame's checkerboard field.
+		int x = blockStart;
+		if(!((x ^ y ^ checker) & 1)) {
+			step();
+			x++;
+		}
+
+		bool written = false;
+		for(; x < blockEnd; x += 2) {
+
+			float z = perspective ? 1.0f / zDivisor : 1.f;
 			float& db = mDepthBuffer[x + y * mWidth];
+
 			if(depth < db) {
-				vec4 sun = mEnableLighting ? mix(mAmbientColor, mSunColor, std::min(1.f, std::max(mAmbientIntensity, dot(normal*z, sunPos)*mSunIntensity))) : 1.f;
-				float zd = (1.0f - (depth / z));
-				zd = Clamp(zd*zd*zd, 0.f, 1.f);
-				mCanvas->set(x, y, (((color * z) * sun) * (color * z) * sun)*(1.0f - zd) + mAmbientColor * mAmbientIntensity*zd);
+				queuePixel<State>(batch, texture, gradients, x, y, color, texCoord, normal, depth, z);
 				db = depth;
+				written = true;
 			}
+
+			step();
+			if(x + 1 < blockEnd) step();
 		}
-		color += gradients.colorXStep();
-		zDivisor += gradients.zDivisorXStep();
-		depth += gradients.depthXStep();
-		normal += gradients.normalXStep();
+		if(written) markHiZDirty(blockStart, y);
+		blockStart = blockEnd;
 	}
+	flushPixels<State>(batch, texture);
 }
 
-
-void RenderContext::scanEdge(const Gradients& gradients, Edge* a, Edge* b, bool handedness) {
+void RenderContext::scanEdge(const Gradients& gradients, const BoundTexture& texture, Edge* a, Edge* b, bool handedness, const ScissorRect& scissor, ScanLineKernel kernel) {
 
 	Edge* left = a;
 	Edge* right = b;
 	if(handedness) std::swap(left, right);
 
 	int yStart = (int)b->yStart();
-	int yEnd = (int)b->yEnd();
+	int yEnd = std::min((int)b->yEnd(), scissor.maxY);
 
-	if(mTexture) {
-		for(int j = yStart; j < yEnd; j++) {
-			drawScanLineTextured(gradients, left, right, j);
-			left->step();
-			right->step();
-		}
-	} else {
-		for(int j = yStart; j < yEnd; j++) {
-			drawScanLine(gradients, left, right, j);
-			left->step();
-			right->step();
-		}
+	for(int j = yStart; j < yEnd; j++) {
+		if(j >= scissor.minY) (this->*kernel)(gradients, texture, left, right, j, scissor);
+		left->step();
+		right->step();
 	}
-}
-
-
+}
\ No newline at end of file
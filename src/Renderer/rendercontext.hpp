@@ -28,51 +28,163 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define RENDERCONTEXT_HPP
 
 #include <vector>
+#include <memory>
 #include "canvas.hpp"
 #include "vertex.hpp"
 #include "../Math/matrix.hpp"
+#include "../Math/transform.hpp"
 #include "mesh.hpp"
 #include "gradients.hpp"
 #include "texture.hpp"
 #include "edge.hpp"
+#include "clipper.hpp"
+
+class ThreadPool;
 
 //Code based on TheBennybox' video tutorial series on software rendering
 class RenderContext {
+
+	public:
+
+		enum class CullMode {
+			None,
+			Back,
+			Front
+		};
+
+		enum class Rasterizer {
+			Scanline, //Edge walking with Edge & Gradients
+			HalfSpace //Edge functions evaluated for 2x2 pixel quads with SSE
+		};
+
+	private:
+
+	//Pixel rectangle, max is exclusive.
+	struct ScissorRect {
+		int minX, minY, maxX, maxY;
+	};
+
+	//Render state the rasterizer kernels are specialized on. Sampling and wraping 
+	//are resolved into BoundTexture::sample and BoundTexture::sampleBatch instead.
+	enum KernelState : unsigned {
+		KernelTextured = 1 << 0,
+		KernelLit = 1 << 1,
+		KernelCheckerOdd = 1 << 2,
+		KernelPerspective = 1 << 3,
+		KernelStateCount = 1 << 4
+	};
+
+	//Texture together with its sampling function for the current sampler.
+	struct BoundTexture {
+		const Texture* texture;
+		Texture::SampleFunction sample;
+		Texture::SampleBatchFunction sampleBatch;
+	};
+
+	//Covered pixels waiting to be textured with one batched sample and shaded.
+	struct PixelBatch {
+		alignas(16) float u[Texture::BatchWidth], v[Texture::BatchWidth], mipLevel[Texture::BatchWidth];
+		int x[Texture::BatchWidth], y[Texture::BatchWidth];
+		vec4 color[Texture::BatchWidth];
+		vec3 normal[Texture::BatchWidth];
+		float depth[Texture::BatchWidth], z[Texture::BatchWidth];
+		int count = 0;
+	};
+
+	typedef void (RenderContext::*ScanLineKernel)(const Gradients&, const BoundTexture&, Edge*, Edge*, int, const ScissorRect&);
+	typedef void (RenderContext::*HalfSpaceKernel)(const Vertex&, const Vertex&, const Vertex&, const BoundTexture&, const ScissorRect&);
+
+	struct RasterKernels {
+		ScanLineKernel scanLine;
+		HalfSpaceKernel halfSpace;
+	};
+
+	//Screen space triangle, which has passed the setup and waits for rasterization.
+	struct BinnedTriangle {
+		Vertex minYV, midYV, maxYV;
+		bool handedness;
+		BoundTexture texture;
+	};
 	
 	mat4 mScreenSpaceTransform;
 	mat4 mViewTrasform;
 
 	Canvas* mCanvas = nullptr;
 	int mWidth, mHeight;
-	const Texture* mTexture = nullptr;
-	float* mDepthBuffer;
+	BoundTexture mTexture = {};
+	float* mDepthBuffer = nullptr;
 	bool mPerspectiveCorrected = true;
 
 	bool mUseTexture = false;
 	bool mEnableLighting = false;
 
 	vec3 mSunPosition = {};
+	vec3 mSunDirection = {};
 	vec4 mSunColor = { 1.f, 1.f, 1.f, 1.f };
 	float mSunIntensity = 4.f;
 
 	vec4 mAmbientColor = { 1.f, 1.f, 1.f, 1.f };
 	float mAmbientIntensity = .2f ;
 
-	Texture::Sampling mSamplingMode;
-	Texture::Wraping mWrapingMode;
+	Sampler mSampler;
+
+	Rasterizer mRasterizer = Rasterizer::Scanline;
+	CullMode mCullMode = CullMode::Back;
 
 	/*	
 	bool mTestMipMap = false;
 	int mMipLevel = 0;
 	*/
 	int mDrawnTriangles = 0;
+	int mCulledTriangles = 0;
+	int mCulledDraws = 0;
+	int mCulledMeshlets = 0;
 	int mCheckerBoard = 0;
 
+	Clipper mClipper;
+
+	struct TransformedStreams {
+		std::vector<float> x, y, z, w;
+		void resize(unsigned size) { x.resize(size); y.resize(size); z.resize(size); w.resize(size); }
+		SoAVec4Out streams() { return { x.data(), y.data(), z.data(), w.data() }; }
+	};
+
+	//Post-transform vertex cache, reused by every drawMesh.
+	std::vector<Vertex> mTransformedVertices;
+	std::vector<Vertex> mScreenVertices;
+	std::vector<unsigned> mOutCodes;
+	TransformedStreams mClipPositions;
+	TransformedStreams mScreenPositions;
+	TransformedStreams mTransformedNormals;
+	float mGuardBand = 4.f; //Side planes are geometrically clipped at mGuardBand * w
+
+	//Sort-middle tiled rendering, triangles are binned into screen tiles 
+	//and each tile is rasterized by one worker thread at the time.
+	bool mTiledRendering = false;
+	int mTileSize = 64;
+	int mTilesX = 0, mTilesY = 0;
+	std::vector<BinnedTriangle> mBinnedTriangles;
+	std::vector<std::vector<unsigned>> mTileBins;
+	std::unique_ptr<ThreadPool> mThreadPool;
+
+	//Hierarchical depth, conservative max depth of each 8x8 block. Both checkerboard 
+	//fields have their own value, because the depth buffer is cleared every other frame.
+	static constexpr int HiZBlockShift = 3;
+	static constexpr float HiZDepthBias = 1e-5f; //Covers the rounding of the stepped depth values
+	bool mHierarchicalZ = true;
+	int mHiZWidth = 0, mHiZHeight = 0;
+	std::vector<float> mHiZ;
+	std::vector<unsigned char> mHiZDirty;
+
 
 	public: 
 	
 		void reset() {
 			mDrawnTriangles = 0;
+			mCulledTriangles = 0;
+			mCulledDraws = 0;
+			mCulledMeshlets = 0;
+			mClipper.resetStats();
 		}
 
 		inline void clearDepthBuffer() {
@@ -80,21 +192,16 @@ class RenderContext {
 			for(int i = 0; i < mWidth*mHeight; i += 4) {
 				_mm_store_ps((float*)mDepthBuffer + i, fill);
 			}
+			std::fill(mHiZ.begin(), mHiZ.end(), 1.0f);
+			std::fill(mHiZDirty.begin(), mHiZDirty.end(), 0);
 		}
 
-		RenderContext() = default;
-		RenderContext(Canvas& canvas): 
-			mCanvas(&canvas) 
-		{
-			mWidth = mCanvas->width();
-			mHeight = mCanvas->height();
-			mScreenSpaceTransform = mat4::ScreenSpace((float)canvas.width() * .5f, (float)canvas.height() * .5f);
-			unsigned size = mWidth * mHeight * sizeof(float);
-			size += (size % 16);
-			mDepthBuffer = (float*)_aligned_malloc(size, 16);
-		}
+		RenderContext();
+		RenderContext(Canvas& canvas);
+		~RenderContext();
 
 		void setCanvas(Canvas& canvas) { 
+			flush();
 			mCanvas = &canvas; 
 			mWidth = mCanvas->width();
 			mHeight = mCanvas->height();
@@ -102,11 +209,21 @@ class RenderContext {
 			unsigned size = mWidth * mHeight * sizeof(float);
 			size += (size % 16);
 			mDepthBuffer = (float*)_aligned_realloc(mDepthBuffer, size, 16);
+			resizeTiles();
+			resizeHiZ();
 		}
 
-		inline void setSamplingMode(Texture::Sampling sampling) { mSamplingMode = sampling; }
+		inline void setSampler(const Sampler& sampler) { mSampler = sampler; bindTexture(mTexture.texture); }
+
+		inline const Sampler& sampler() const { return mSampler; }
 
-		inline void setTextureWrapingMode(Texture::Wraping wrapingMode) { mWrapingMode = wrapingMode; }
+		inline void setSamplingMode(Texture::Sampling sampling) { setSampler(Sampler(sampling, mSampler.wraping())); }
+
+		inline void setTextureWrapingMode(Texture::Wraping wrapingMode) { setSampler(Sampler(mSampler.sampling(), wrapingMode)); }
+
+		inline void setRasterizer(Rasterizer rasterizer) { flush(); mRasterizer = rasterizer; }
+
+		inline Rasterizer rasterizer() const { return mRasterizer; }
 
 		/*
 		void testMipmap(bool test) {
@@ -131,9 +248,9 @@ class RenderContext {
 
 		void drawMesh(const Mesh& mesh, const mat4& transform, const mat4& normalMatrix = mat4::Identity());
 
-		inline void setTexture(const Texture& texture) { mTexture = &texture; }
+		inline void setTexture(const Texture& texture) { bindTexture(&texture); }
 		
-		inline void resetTexture() { mTexture = nullptr; }
+		inline void resetTexture() { bindTexture(nullptr); }
 		
 		inline void setTextureUsage(bool b) { mUseTexture = b; }
 
@@ -143,13 +260,31 @@ class RenderContext {
 
 		void fillTriangle(const Vertex& a, const Vertex& b, const Vertex& c);
 
+		//When tiled rendering is enabled, triangles given to fillTriangle are only 
+		//binned, flush() rasterizes them. drawMesh flushes by itself.
+		void enableTiledRendering(bool tiled, unsigned threads = 0);
+
+		void setTileSize(int size);
+
+		void flush();
+
+		inline bool isTiledRendering() const { return mTiledRendering; }
+
+		inline int tileSize() const { return mTileSize; }
+
+		inline void enableHierarchicalZ(bool hiZ) { flush(); mHierarchicalZ = hiZ; }
+
+		inline bool isHierarchicalZ() const { return mHierarchicalZ; }
+
 		void advanceCheckerboard() { mCheckerBoard = (mCheckerBoard+1)&1; }
 
 		int checkerBoard() const { return mCheckerBoard; }
 
 		inline void enableLighting(bool lighting) { mEnableLighting = lighting; }
 
-		inline void setSunPosition(const vec3& position) { mSunPosition = position; }
+		inline void enablePerspectiveCorrection(bool perspective) { mPerspectiveCorrected = perspective; }
+
+		inline void setSunPosition(const vec3& position) { mSunPosition = position; mSunDirection = position.normalized(); }
 
 		inline void setSunColor(const vec3& color) { mSunColor = color; }
 
@@ -161,8 +296,30 @@ class RenderContext {
 
 		inline int renderedTriangles() const { return mDrawnTriangles;  }
 
+		//Triangles rejected by the cull mode before clipping.
+		inline int culledTriangles() const { return mCulledTriangles; }
+
+		//Draws rejected as a whole by their bounding volumes.
+		inline int culledDraws() const { return mCulledDraws; }
+
+		//Meshlets rejected as a whole by their bounds or normal cones.
+		inline int culledMeshlets() const { return mCulledMeshlets; }
+
+		inline void setCullMode(CullMode mode) { mCullMode = mode; }
+
+		inline CullMode cullMode() const { return mCullMode; }
+
+		inline const Clipper::Stats& clipStats() const { return mClipper.stats(); }
+
+		//Extent of the guard band relative to the view volume, 1 disables it.
+		inline void setGuardBand(float extent) { mGuardBand = std::max(1.f, extent); }
+
+		inline float guardBand() const { return mGuardBand; }
+
 		inline bool isLighting() const { return mEnableLighting; }
 
+		inline bool isPerspectiveCorrected() const { return mPerspectiveCorrected; }
+
 		inline const vec3& sunPosition() const { return mSunPosition; }
 
 		inline vec3 sunColor() const { return mSunColor.xyz(); }
@@ -175,15 +332,93 @@ class RenderContext {
 
 	private:
 
+		void drawTriangles(const Mesh& mesh, const mat4& transform, const mat4& normalMatrix);
+
+		//Transforms the vertices first to first + count into the post-transform cache.
+		void transformVertices(const Mesh& mesh, unsigned first, unsigned count, const mat4& transform, const mat4& normalMatrix, bool inside);
+
+		//Draws the triangles first to first + count, their vertices have to be transformed.
+		void drawFaces(const Mesh& mesh, unsigned first, unsigned count, bool inside);
+
+		static vec4 ClipSpaceEye(const mat4& transform);
+
+		//Tells whether the cull mode rejects every triangle of the meshlet.
+		bool isCulled(const Mesh::Meshlet& meshlet, const vec4& eye) const;
+
+		//Rejects degenerate triangles and the faces selected by the cull mode, 
+		//frontFacing is positive for counter clockwise triangles in NDC.
+		inline bool isCulled(float frontFacing) const {
+			if(frontFacing == 0.f) return true;
+			switch(mCullMode) {
+				case CullMode::Back: return frontFacing < 0.f;
+				case CullMode::Front: return frontFacing > 0.f;
+				default: return false;
+			}
+		}
+
+		//Takes screen space vertices.
+		void setupTriangle(const Vertex& a, const Vertex& b, const Vertex& c);
+
+		void fillTriangle(const Vertex& a, const Vertex& b, const Vertex& c, const Vertex* screenA, const Vertex* screenB, const Vertex* screenC, unsigned codeA, unsigned codeB, unsigned codeC);
+
+		void resizeTiles();
+
+		void binTriangle(const Vertex& minYV, const Vertex& midYV, const Vertex& maxYV, bool handedness);
+
+		inline ScissorRect canvasRect() const { return { 0, 0, mWidth, mHeight }; }
+
+		void resizeHiZ();
+
+		//The pixel parity drawn this frame, (x ^ y) & 1.
+		inline int hiZField() const { return (mCheckerBoard & 1) ^ 1; }
+
+		inline void markHiZDirty(int x, int y) { mHiZDirty[(((x >> HiZBlockShift) + (y >> HiZBlockShift) * mHiZWidth) << 1) + hiZField()] = 1; }
+
+		float hiZMaxDepth(int blockX, int blockY);
+
+		bool isOccluded(const ScissorRect& rect, float minDepth);
+
+		inline bool isBlockOccluded(int x, int y, float minDepth) {
+			return mHierarchicalZ && minDepth - HiZDepthBias >= hiZMaxDepth(x >> HiZBlockShift, y >> HiZBlockShift);
+		}
+
+		void rasterizeTriangle(const Vertex& minYV, const Vertex& midYV, const Vertex& maxYV, bool handedness, const BoundTexture& texture, const ScissorRect& scissor);
+
+		inline void bindTexture(const Texture* texture) { 
+			mTexture = { texture, texture ? mSampler.resolve(*texture) : nullptr, texture ? mSampler.resolveBatch(*texture) : nullptr }; 
+		}
+
+		unsigned kernelState(const BoundTexture& texture) const;
+
+		static const RasterKernels& Kernels(unsigned state);
+
+		template<unsigned Count>
+		static void FillKernels(RasterKernels* kernels);
+
+		template<unsigned State>
+		void rasterizeHalfSpace(const Vertex& a, const Vertex& b, const Vertex& c, const BoundTexture& texture, const ScissorRect& scissor);
+
+		//Mip level from the screen space derivatives of the texture coordinates at the pixel.
+		template<unsigned State>
+		static inline float TextureLod(const Texture* texture, const Gradients& gradients, const vec2& uv, float z);
+
+		//Texel is the sampled texture color, untextured kernels ignore it.
+		template<unsigned State>
+		inline vec4 shade(const vec4& texel, const vec4& color, const vec3& normal, float depth, float z) const;
 
-		void scanTriangle(const Vertex& a, const Vertex& b, const Vertex& c, bool handedness);
+		//Untextured pixels are shaded right away, textured ones once the batch is full or flushed.
+		template<unsigned State>
+		inline void queuePixel(PixelBatch& batch, const BoundTexture& texture, const Gradients& gradients, int x, int y, const vec4& color, const vec2& texCoord, const vec3& normal, float depth, float z);
 
-		void drawScanLineTextured(const Gradients& gradients, Edge* a, Edge* b, int y);
+		template<unsigned State>
+		void flushPixels(PixelBatch& batch, const BoundTexture& texture);
 
-		void drawScanLine(const Gradients& gradients, Edge* a, Edge* b, int y);
+		void scanTriangle(const Vertex& a, const Vertex& b, const Vertex& c, bool handedness, const BoundTexture& texture, const ScissorRect& scissor, ScanLineKernel kernel);
 
-		void scanEdge(const Gradients& gradients, Edge* a, Edge* b, bool handedness);
+		template<unsigned State>
+		void drawScanLine(const Gradients& gradients, const BoundTexture& texture, Edge* a, Edge* b, int y, const ScissorRect& scissor);
 
+		void scanEdge(const Gradients& gradients, const BoundTexture& texture, Edge* a, Edge* b, bool handedness, const ScissorRect& scissor, ScanLineKernel kernel);
 
 };
 
@@ -29,77 +29,387 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define STB_IMAGE_IMPLEMENTATION 
 #include "../stb/stb_image.h" 
 
+#include <ostream>
+#include <cstdio>
 
+//Cache file layout: header, source path, padding, then the texels of every level as in mData.
+struct TextureCacheHeader {
+	char magic[4];
+	unsigned version;
+	unsigned long long sourceSize;
+	unsigned long long sourceModified;
+	int width, height;
+	int format, layout;
+	int mipLevels;
+	unsigned pathLength;
+	unsigned dataOffset;
+	unsigned dataSize;
+};
 
-Texture::Texture(const std::string& path) {
-	load(path);
+static const char CacheMagic[4] = { 'T', 'E', 'X', 'C' };
+static const unsigned CacheVersion = 1;
+
+static std::string& CacheDirectory() {
+	static std::string directory;
+	return directory;
+}
+
+//Different storage of the same image gets its own cache file.
+static std::string CachePath(const std::string& path, Texture::Format format, Texture::Layout layout) {
+	unsigned long long hash = 1469598103934665603ULL;
+	for(char c : path) {
+		hash ^= (unsigned char)c;
+		hash *= 1099511628211ULL;
+	}
+	hash ^= (unsigned)format * 2 + (unsigned)layout;
+	hash *= 1099511628211ULL;
+
+	size_t slash = path.find_last_of("/\\");
+	std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+	char key[17];
+	snprintf(key, sizeof(key), "%016llx", hash);
+	return CacheDirectory() + name + "." + key + ".texcache";
+}
+
+void Texture::SetCacheDirectory(const std::string& directory) {
+	CacheDirectory() = directory;
+	if(!directory.empty() && directory.back() != '/' && directory.back() != '\\') CacheDirectory() += '/';
+}
+
+
+Texture::Texture(const std::string& path, Format format, Layout layout) {
+	load(path, format, layout);
 }
 
-bool Texture::load(const std::string& path) {
+bool Texture::load(const std::string& path, Format format, Layout layout) {
+
+	unsigned long long sourceSize, sourceModified;
+	std::string cachePath;
+	if(!CacheDirectory().empty() && MappedFile::Stat(path, sourceSize, sourceModified)) {
+		cachePath = CachePath(path, format, layout);
+		if(loadCache(cachePath, path, format, layout, sourceSize, sourceModified)) return true;
+	}
 	
-	int channels; 
-	stbi_uc* pixels = stbi_load(path.c_str(), &mSize.x, &mSize.y, &channels, 4);
-	if(!pixels)
-		return false; 
-	mPixels = new vec4[mSize.x * mSize.y];
-	stbi_uc* ptr = pixels;
-
-	for(int y = 0; y < mSize.y; y++)
-	for(int x = 0; x < mSize.x; x++)
-	{
-		mPixels[x + y * mSize.x] = PixelToVec4(*(int*)ptr);
-		ptr += 4;
+	int width, height, channels; 
+	std::vector<vec4> pixels;
+
+	//HDR images keep their range, which only the F16 format can store.
+	if(stbi_is_hdr(path.c_str())) {
+		float* hdr = stbi_loadf(path.c_str(), &width, &height, &channels, 4);
+		if(!hdr)
+			return false; 
+		pixels.resize(width * height);
+		for(int i = 0; i < width * height; i++) {
+			pixels[i] = { hdr[i * 4], hdr[i * 4 + 1], hdr[i * 4 + 2], hdr[i * 4 + 3] };
+		}
+		stbi_image_free(hdr);
+	} else {
+		stbi_uc* ldr = stbi_load(path.c_str(), &width, &height, &channels, 4);
+		if(!ldr)
+			return false; 
+		pixels.resize(width * height);
+		for(int i = 0; i < width * height; i++) {
+			pixels[i] = PixelToVec4(*(int*)(ldr + i * 4));
+		}
+		stbi_image_free(ldr);
 	}
 
-	constexpr unsigned middle = 1 << 31;
-	mTextureOffset.x = (middle / (unsigned)mSize.x) * (unsigned)mSize.x;
-	mTextureOffset.y = (middle / (unsigned)mSize.y) * (unsigned)mSize.y;
+	create(width, height, std::move(pixels), format, layout);
+	mPath = path;
 
-	mMipLevelsPerAxis.x = (int)log2(mSize.x);
-	mMipLevelsPerAxis.y = (int)log2(mSize.y);
-	mMipLevels = std::max(mMipLevelsPerAxis.x, mMipLevelsPerAxis.y);
+	//The texture is still usable when its cache can't be written.
+	if(!cachePath.empty()) saveCache(cachePath, path, sourceSize, sourceModified);
 
-	stbi_image_free(pixels);
 	return true;
 }
 
-vec4 Texture::sample(float x, float y, int mipLevel, Sampling sampling, Wraping wraping) const {
-	
-	x *= mSize.x;
-	y *= mSize.y;
+void Texture::create(int width, int height, std::vector<vec4> pixels, Format format, Layout layout) {
+	mSize = { width, height };
+	mFormat = format;
+	mLayout = layout;
+	mPowerOfTwo = !(mSize.x & (mSize.x - 1)) && !(mSize.y & (mSize.y - 1));
+	mMipLevels = (int)log2(std::max(mSize.x, mSize.y));
+	mPath.clear();
+	mResidentLevel = 0;
+	buildMipChain(pixels);
+}
+
+bool Texture::setResidentLevel(int level) {
+	level = Clamp(level, 0, mMipLevels);
+	if(level >= mResidentLevel) {
+		moveLevels(level, nullptr);
+		return true;
+	}
+
+	//Only the missing levels are read from the cache mapping. Without a current 
+	//cache they have to come from a decoded source, through streamIn.
+	Texture source;
+	return !mPath.empty() && source.mapCache(mPath, mFormat, mLayout) && streamIn(level, source);
+}
+
+bool Texture::streamIn(int level, const Texture& source) {
+	level = Clamp(level, 0, mMipLevels);
+	if(level >= mResidentLevel) return true;
+
+	//A source that no longer matches isn't used, the sampling functions bound 
+	//for this texture depend on its size, format and layout.
+	if(source.mSize.x != mSize.x || source.mSize.y != mSize.y || source.mFormat != mFormat || source.mLayout != mLayout || 
+		source.mPowerOfTwo != mPowerOfTwo || source.mMipLevels != mMipLevels || source.mResidentLevel > level) return false;
+	moveLevels(level, &source);
+	return true;
+}
+
+void Texture::moveLevels(int level, const Texture* source) {
+	if(level == mResidentLevel) return;
+
+	//The kept levels are moved into an allocation of their own, next to the streamed in ones.
+	int texelSize = TexelSize(mFormat);
+	unsigned char* data = new unsigned char[levelBytes(level)];
+	unsigned char* next = data;
+	for(int i = 0; i <= mMipLevels; i++) {
+		MipLevel& mipLevel = mLevels[i];
+		if(i < level) {
+			mipLevel.data = nullptr;
+			continue;
+		}
+		unsigned bytes = levelTexels(mipLevel) * texelSize;
+		memcpy(next, i < mResidentLevel ? source->mLevels[i].data : mipLevel.data, bytes);
+		mipLevel.data = next;
+		next += bytes;
+	}
+
+	delete [] mData;
+	mData = data;
+	mFile.close();
+	mResidentLevel = level;
+}
+
+unsigned Texture::levelBytes(int level) const {
+	unsigned bytes = 0;
+	for(int i = std::max(level, 0); i <= mMipLevels; i++) bytes += levelTexels(mLevels[i]) * TexelSize(mFormat);
+	return bytes;
+}
 
-	int mipX = mSize.x / ((1<<(mMipLevelsPerAxis.x)) >> mipLevel);
-	int mipY = mSize.y / ((1<<(mMipLevelsPerAxis.y)) >> mipLevel);
+bool Texture::mapCache(const std::string& path, Format format, Layout layout) {
+	unsigned long long sourceSize, sourceModified;
+	if(CacheDirectory().empty() || !MappedFile::Stat(path, sourceSize, sourceModified)) return false;
+	return loadCache(CachePath(path, format, layout), path, format, layout, sourceSize, sourceModified);
+}
+
+bool Texture::loadCache(const std::string& cachePath, const std::string& path, Format format, Layout layout, unsigned long long sourceSize, unsigned long long sourceModified) {
+	MappedFile file;
+	if(!file.open(cachePath) || file.size() < sizeof(TextureCacheHeader)) return false;
+
+	//Stale or foreign caches are ignored, the next save replaces them.
+	TextureCacheHeader header;
+	memcpy(&header, file.data(), sizeof(header));
+	if(memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) || header.version != CacheVersion) return false;
+	if(header.sourceSize != sourceSize || header.sourceModified != sourceModified) return false;
+	if(header.format != (int)format || header.layout != (int)layout) return false;
+	if(header.pathLength != path.size() || sizeof(header) + header.pathLength > file.size()) return false;
+	if(memcmp(file.data() + sizeof(header), path.data(), path.size())) return false;
+	if((unsigned long long)header.dataOffset + header.dataSize > file.size()) return false;
+
+	if(header.width <= 0 || header.height <= 0 || header.mipLevels != (int)log2(std::max(header.width, header.height))) return false;
+	if((unsigned long long)header.width * header.height * TexelSize(format) > header.dataSize) return false;
+
+	//The levels are laid out aside, the texture only changes once they match the data.
+	Texture cached;
+	cached.mSize = { header.width, header.height };
+	cached.mFormat = format;
+	cached.mMipLevels = header.mipLevels;
+	cached.layoutMipChain();
+	if(cached.levelBytes(0) != header.dataSize) return false;
+
+	mSize = cached.mSize;
+	mFormat = format;
+	mLayout = layout;
+	mPowerOfTwo = !(mSize.x & (mSize.x - 1)) && !(mSize.y & (mSize.y - 1));
+	mMipLevels = header.mipLevels;
+	mLevels.swap(cached.mLevels);
+	mPath = path;
+	mResidentLevel = 0;
+	delete [] mData;
+	mData = nullptr;
+	mFile = std::move(file);
+
+	const unsigned char* data = mFile.data() + header.dataOffset;
+	for(MipLevel& level : mLevels) {
+		level.data = data;
+		data += levelTexels(level) * TexelSize(mFormat);
+	}
+	return true;
+}
 
-	switch(sampling) {
-		case Sampling::None: 
-			return sample(((int)x / mipX)*mipX, ((int)y / mipY)*mipY, wraping); break;
-		case Sampling::Linear: 
-		case Sampling::CubicHermite:
-		{
+bool Texture::saveCache(const std::string& cachePath, const std::string& path, unsigned long long sourceSize, unsigned long long sourceModified) const {
+	TextureCacheHeader header = {};
+	memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+	header.version = CacheVersion;
+	header.sourceSize = sourceSize;
+	header.sourceModified = sourceModified;
+	header.width = mSize.x;
+	header.height = mSize.y;
+	header.format = (int)mFormat;
+	header.layout = (int)mLayout;
+	header.mipLevels = mMipLevels;
+	header.pathLength = (unsigned)path.size();
+	//Texels start at a cache line, the mapping itself is page aligned.
+	header.dataOffset = (unsigned)(sizeof(header) + path.size() + 63) & ~63u;
+	header.dataSize = levelBytes(0);
 
-			float fracX = (x / mipX) - FastFloor(x / mipX);
-			float fracY = (y / mipY) - FastFloor(y / mipY);
+	return MappedFile::Write(cachePath, [&](std::ostream& out) {
+		char padding[64] = {};
+		out.write((const char*)&header, sizeof(header));
+		out.write(path.data(), path.size());
+		out.write(padding, header.dataOffset - sizeof(header) - path.size());
+		out.write((const char*)mData, header.dataSize);
+	});
+}
 
-			if(sampling == Sampling::CubicHermite) {
-				fracX = (fracX * fracX * (3.f - 2.f*fracX));
-				fracY = (fracY * fracY * (3.f - 2.f*fracY));
+//Converts a texel to the storage format, rounding to the nearest representable value.
+static void Pack(Texture::Format format, const vec4& texel, unsigned char* out) {
+	__m128 v = _mm_loadu_ps(&texel.x);
+	switch(format) {
+		case Texture::Format::RGBA8: {
+			__m128i c = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.f)), _mm_set1_ps(255.f)));
+			c = _mm_packs_epi32(c, c);
+			c = _mm_packus_epi16(c, c);
+			*(int*)out = _mm_cvtsi128_si32(c);
+		} break;
+		case Texture::Format::RGB565: {
+			__m128i c = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.f)), _mm_set_ps(0.f, 31.f, 63.f, 31.f)));
+			int r = _mm_cvtsi128_si32(c);
+			int g = _mm_cvtsi128_si32(_mm_srli_si128(c, 4));
+			int b = _mm_cvtsi128_si32(_mm_srli_si128(c, 8));
+			*(unsigned short*)out = (unsigned short)((r << 11) | (g << 5) | b);
+		} break;
+		case Texture::Format::F16: {
+			#if defined(__F16C__) || defined(__AVX2__)
+			_mm_storel_epi64((__m128i*)out, _mm_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+			#else
+			unsigned short* half = (unsigned short*)out;
+			for(int i = 0; i < 4; i++) {
+				float f = texel[i];
+				unsigned bits;
+				memcpy(&bits, &f, sizeof(bits));
+				unsigned sign = (bits >> 16) & 0x8000u;
+				int exponent = (int)((bits >> 23) & 0xFF) - 112;
+				unsigned mantissa = bits & 0x7FFFFF;
+				if(exponent >= 0x1F) {
+					half[i] = (unsigned short)(sign | 0x7C00u | (((bits & 0x7FFFFFFF) > 0x7F800000u) ? 0x200u : 0u));
+				} else if(exponent <= 0) {
+					//Denormal or zero
+					if(exponent < -10) { half[i] = (unsigned short)sign; continue; }
+					mantissa |= 0x800000;
+					unsigned shift = 14 - exponent;
+					unsigned rounded = (mantissa + (1u << (shift - 1))) >> shift;
+					half[i] = (unsigned short)(sign | rounded);
+				} else {
+					unsigned rounded = ((unsigned)exponent << 10) + ((mantissa + 0x1000) >> 13);
+					half[i] = (unsigned short)(sign | std::min(rounded, 0x7C00u));
+				}
 			}
+			#endif
+		} break;
+	}
+}
 
-			int sx = ((int)x / mipX) * mipX;
-			int sy = ((int)y / mipY) * mipY;
+void Texture::layoutMipChain() {
+	
+	constexpr unsigned middle = 1 << 31;
+
+	//Level n is (size >> n) but at least 1x1.
+	mLevels.resize(mMipLevels + 1);
+	for(int i = 0; i <= mMipLevels; i++) {
+		MipLevel& level = mLevels[i];
+		level.size = { std::max(1, mSize.x >> i), std::max(1, mSize.y >> i) };
+		level.offset.x = (middle / (unsigned)level.size.x) * (unsigned)level.size.x;
+		level.offset.y = (middle / (unsigned)level.size.y) * (unsigned)level.size.y;
+		level.blocksX = (level.size.x + 3) >> 2;
+	}
+}
 
-			vec4 a = sample(sx, sy, wraping);
-			vec4 b = sample(sx + mipX, sy, wraping);
-			vec4 c = sample(sx, sy + mipY, wraping);
-			vec4 d = sample(sx + mipX, sy + mipY, wraping);
-			
-			return a + fracX * (b - a) + fracY * (c - a) * (1.0f - fracX) + fracX * fracY * (d - b);
+void Texture::buildMipChain(std::vector<vec4>& pixels) {
 
+	int texelSize = TexelSize(mFormat);
+
+	//All the levels are allocated at once.
+	layoutMipChain();
+	mFile.close();
+	delete [] mData;
+	mData = new unsigned char[levelBytes(0)];
+
+	//Filtering is done in floats, each level is packed when it's done.
+	std::vector<vec4> next;
+	unsigned char* data = mData;
+	for(int i = 0; i <= mMipLevels; i++) {
+		MipLevel& level = mLevels[i];
+		level.data = data;
+		for(int y = 0; y < level.size.y; y++) 
+		for(int x = 0; x < level.size.x; x++) {
+			unsigned index = mLayout == Layout::Tiled ? TexelIndex<Layout::Tiled>(level, x, y) : TexelIndex<Layout::Linear>(level, x, y);
+			Pack(mFormat, pixels[x + y * level.size.x], data + index * texelSize);
 		}
-	
+		data += levelTexels(level) * texelSize;
+
+		if(i == mMipLevels) break;
+
+		//2x2 box filter for the next level, odd edges repeat their last texel.
+		const ivec2& src = level.size;
+		ivec2 dst = { std::max(1, src.x >> 1), std::max(1, src.y >> 1) };
+		next.resize(dst.x * dst.y);
+		for(int y = 0; y < dst.y; y++) {
+			int y0 = std::min(y * 2, src.y - 1);
+			int y1 = std::min(y * 2 + 1, src.y - 1);
+			for(int x = 0; x < dst.x; x++) {
+				int x0 = std::min(x * 2, src.x - 1);
+				int x1 = std::min(x * 2 + 1, src.x - 1);
+				next[x + y * dst.x] = (
+					pixels[x0 + y0 * src.x] + pixels[x1 + y0 * src.x] +
+					pixels[x0 + y1 * src.x] + pixels[x1 + y1 * src.x]) * .25f;
+			}
+		}
+		pixels.swap(next);
 	}
+}
 
-	return vec4{ 0.0f };
+template<>
+void Texture::FillSampleFunctions<0>(SampleFunction*, SampleBatchFunction*) {}
 
+template<int Count>
+void Texture::FillSampleFunctions(SampleFunction* functions, SampleBatchFunction* batchFunctions) {
+	const int Index = Count - 1;
+	const Sampling S = (Sampling)(Index % 3);
+	const Wraping W = (Wraping)((Index / 3) % 2);
+	const bool P = ((Index / 6) % 2) != 0;
+	const Layout L = (Layout)((Index / 12) % 2);
+	const Format F = (Format)((Index / 24) % 3);
+	//Point sampling has nothing to filter, so it is the same function for both.
+	const bool FixedPoint = Index >= SampleFunctionCount / 2 && F == Format::RGBA8 && S != Sampling::None;
+	functions[Index] = FixedPoint ? &Texture::sampleLevelsFixed<L, P, S, W> : &Texture::sampleLevels<F, L, P, S, W>;
+	batchFunctions[Index] = FixedPoint ? &Texture::sampleLevelsFixedBatch<L, P, S, W> : &Texture::sampleLevelsBatch<F, L, P, S, W>;
+	FillSampleFunctions<Index>(functions, batchFunctions);
+}
+
+const Texture::SampleFunctionTable& Texture::SampleFunctions() {
+	static const SampleFunctionTable table = []() {
+		SampleFunctionTable table;
+		table.functions.resize(SampleFunctionCount);
+		table.batchFunctions.resize(SampleFunctionCount);
+		FillSampleFunctions<SampleFunctionCount>(table.functions.data(), table.batchFunctions.data());
+		return table;
+	}();
+	return table;
+}
+
+Texture::SampleFunction Texture::sampleFunction(Sampling sampling, Wraping wraping) const {
+	return SampleFunctions().functions[SampleFunctionIndex(mFormat, mLayout, mPowerOfTwo, mFixedPoint, sampling, wraping)];
+}
+
+Texture::SampleBatchFunction Texture::sampleBatchFunction(Sampling sampling, Wraping wraping) const {
+	return SampleFunctions().batchFunctions[SampleFunctionIndex(mFormat, mLayout, mPowerOfTwo, mFixedPoint, sampling, wraping)];
+}
+
+vec4 Texture::sample(float x, float y, int mipLevel, Sampling sampling, Wraping wraping) const {
+	return (this->*sampleFunction(sampling, wraping))(x, y, (float)mipLevel);
 }
@@ -29,17 +29,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "../Math/vec4.hpp"
 #include "../Math/vec2.hpp"
+#include "../System/mappedfile.hpp"
 #include <string>
+#include <vector>
+#include <cstring>
+#include <atomic>
+#include <climits>
+#include <cmath>
 
 class Texture { 
-	
-	vec4* mPixels = nullptr; //Store the pixel data as floats, so there's no need for byte -> float conversion.
-	ivec2 mSize; 
-	
-	uvec2 mTextureOffset; //We need this for repeat wrap mode, because of modulo operator
-
-	ivec2 mMipLevelsPerAxis;
-	int mMipLevels;
 
 	public:
 		
@@ -54,63 +52,532 @@ class Texture {
 			Repeat
 		};
 
+		//Texel storage formats, unpacked to vec4 when fetched.
+		enum class Format {
+			RGBA8,
+			RGB565,
+			F16 //4 half floats
+		};
+
+		//Texel order in memory. Tiled stores 4x4 texel blocks one after another, 
+		//so bilinear taps and diagonal spans stay within fewer cache lines.
+		enum class Layout {
+			Linear,
+			Tiled
+		};
+
+		//A sampling function specialized for the storage of one texture, see sampleFunction.
+		typedef vec4 (Texture::*SampleFunction)(float x, float y, float mipLevel) const;
+
+		//Pixels sampled by one call of a SampleBatchFunction, one SSE lane each.
+		static constexpr int BatchWidth = 4;
+
+		//Samples BatchWidth pixels at once, every array holds one value per pixel.
+		typedef void (Texture::*SampleBatchFunction)(const float* x, const float* y, const float* mipLevel, vec4* out) const;
+
+	private:
+
+	struct MipLevel {
+		const unsigned char* data;
+		ivec2 size;
+		uvec2 offset; //We need this for repeat wrap mode, because of modulo operator
+		int blocksX; //4x4 blocks per row in the tiled layout
+	};
+
+	unsigned char* mData = nullptr;
+	MappedFile mFile; //Holds the texels instead of mData when loaded from the cache
+	ivec2 mSize; 
+	Format mFormat = Format::RGBA8;
+	Layout mLayout = Layout::Linear;
+	bool mPowerOfTwo = false; //Repeat wraping can mask instead of modulo
+	bool mFixedPoint = false; //Filter RGBA8 texels with integer math
+	std::string mPath; //Source of the texels, evicted levels are streamed back in from it
+
+	//Levels finer than this have been evicted, sampling is clamped to it.
+	int mResidentLevel = 0;
+	//Finest level the rasterizer asked for since the last takeRequestedLevel.
+	mutable std::atomic<int> mRequestedLevel{ INT_MAX };
+
+	//Every level of the mip chain lives in mData, level 0 first.
+	std::vector<MipLevel> mLevels;
+	int mMipLevels = 0;
+
+	//Sizes of every level for mSize and mMipLevels, data pointers are set by the caller.
+	void layoutMipChain();
+
+	void buildMipChain(std::vector<vec4>& pixels);
+
+	//Keeps level and the coarser ones, the levels finer than the resident one are copied from source.
+	void moveLevels(int level, const Texture* source);
+
+	//Maps the current cache of path, without decoding the image when there's none.
+	bool mapCache(const std::string& path, Format format, Layout layout);
+
+	bool loadCache(const std::string& cachePath, const std::string& path, Format format, Layout layout, unsigned long long sourceSize, unsigned long long sourceModified);
+
+	bool saveCache(const std::string& cachePath, const std::string& path, unsigned long long sourceSize, unsigned long long sourceModified) const;
+
+	void swap(Texture& b) {
+		std::swap(mData, b.mData);
+		mFile.swap(b.mFile);
+		std::swap(mSize, b.mSize);
+		std::swap(mFormat, b.mFormat);
+		std::swap(mLayout, b.mLayout);
+		std::swap(mPowerOfTwo, b.mPowerOfTwo);
+		std::swap(mFixedPoint, b.mFixedPoint);
+		std::swap(mPath, b.mPath);
+		std::swap(mResidentLevel, b.mResidentLevel);
+		mRequestedLevel.store(b.mRequestedLevel.exchange(mRequestedLevel.load()));
+		std::swap(mLevels, b.mLevels);
+		std::swap(mMipLevels, b.mMipLevels);
+	}
+
+	static inline float HalfToFloat(unsigned short half) {
+		unsigned sign = (half & 0x8000u) << 16;
+		unsigned exponent = (half >> 10) & 0x1F;
+		unsigned mantissa = half & 0x3FF;
+		unsigned bits;
+		if(exponent == 0x1F) {
+			bits = sign | 0x7F800000u | (mantissa << 13);
+		} else if(exponent) {
+			bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+		} else if(mantissa) {
+			//Denormal, renormalize it for the float
+			exponent = 113;
+			while(!(mantissa & 0x400)) { mantissa <<= 1; exponent--; }
+			bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+		} else {
+			bits = sign;
+		}
+		float out;
+		memcpy(&out, &bits, sizeof(out));
+		return out;
+	}
+
+	template<Format F>
+	static inline vec4 Unpack(const unsigned char* texel) {
+		__m128 v;
+		if(F == Format::RGBA8) {
+			__m128i zero = _mm_setzero_si128();
+			__m128i c = _mm_cvtsi32_si128(*(const int*)texel);
+			c = _mm_unpacklo_epi16(_mm_unpacklo_epi8(c, zero), zero);
+			v = _mm_div_ps(_mm_cvtepi32_ps(c), _mm_set1_ps(255.f));
+		} else if(F == Format::RGB565) {
+			__m128i c = _mm_set1_epi32(*(const unsigned short*)texel);
+			c = _mm_and_si128(c, _mm_set_epi32(0, 0x1F, 0x7E0, 0xF800));
+			v = _mm_mul_ps(_mm_cvtepi32_ps(c), _mm_set_ps(0.f, 1.f / 0x1F, 1.f / 0x7E0, 1.f / 0xF800));
+			v = _mm_add_ps(v, _mm_set_ps(1.f, 0.f, 0.f, 0.f));
+		} else {
+			#if defined(__F16C__) || defined(__AVX2__)
+			v = _mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)texel));
+			#else
+			const unsigned short* half = (const unsigned short*)texel;
+			v = _mm_set_ps(HalfToFloat(half[3]), HalfToFloat(half[2]), HalfToFloat(half[1]), HalfToFloat(half[0]));
+			#endif
+		}
+		return *(vec4*)&v;
+	}
+
+	template<Layout L>
+	static inline unsigned TexelIndex(const MipLevel& level, unsigned x, unsigned y) {
+		if(L == Layout::Tiled) return (((y >> 2) * level.blocksX + (x >> 2)) << 4) | ((y & 3) << 2) | (x & 3);
+		return x + y * level.size.x;
+	}
+
+	template<Format F, Layout L, bool P, Wraping W>
+	inline const unsigned char* texelAddress(const MipLevel& level, int x, int y) const {
+		unsigned sx, sy;
+		if(W == Wraping::Repeat && P) {
+			sx = (unsigned)x & (unsigned)(level.size.x - 1);
+			sy = (unsigned)y & (unsigned)(level.size.y - 1);
+		} else if(W == Wraping::Repeat) {
+			sx = (level.offset.x + x) % (unsigned)level.size.x;
+			sy = (level.offset.y + y) % (unsigned)level.size.y;
+		} else {
+			sx = Clamp(x, 0, level.size.x-1);
+			sy = Clamp(y, 0, level.size.y-1);
+		}
+
+		return level.data + TexelIndex<L>(level, sx, sy) * TexelSize(F);
+	}
+
+	template<Format F, Layout L, bool P, Wraping W>
+	inline vec4 fetch(int x, int y, int mipLevel) const {
+		return Unpack<F>(texelAddress<F, L, P, W>(mLevels[mipLevel], x, y));
+	}
+
+	template<Format F, Layout L, bool P, Sampling S, Wraping W>
+	inline vec4 sampleLevel(float x, float y, int mipLevel) const {
+
+		const ivec2& size = mLevels[mipLevel].size;
+		x *= size.x;
+		y *= size.y;
+
+		float floorX = FastFloor(x);
+		float floorY = FastFloor(y);
+
+		int sx = (int)floorX;
+		int sy = (int)floorY;
+
+		if(S == Sampling::None) return fetch<F, L, P, W>(sx, sy, mipLevel);
+
+		float fracX = x - floorX;
+		float fracY = y - floorY;
+
+		if(S == Sampling::CubicHermite) {
+			fracX = (fracX * fracX * (3.f - 2.f*fracX));
+			fracY = (fracY * fracY * (3.f - 2.f*fracY));
+		}
+
+		vec4 a = fetch<F, L, P, W>(sx, sy, mipLevel);
+		vec4 b = fetch<F, L, P, W>(sx + 1, sy, mipLevel);
+		vec4 c = fetch<F, L, P, W>(sx, sy + 1, mipLevel);
+		vec4 d = fetch<F, L, P, W>(sx + 1, sy + 1, mipLevel);
+		
+		return a + fracX * (b - a) + fracY * (c - a) * (1.0f - fracX) + fracX * fracY * (d - b);
+	}
+
+	template<Format F, Layout L, bool P, Sampling S, Wraping W>
+	vec4 sampleLevels(float x, float y, float mipLevel) const {
+		mipLevel = std::max(mipLevel, (float)mResidentLevel);
+		float current = FastFloor(mipLevel);
+		float frac = mipLevel - current;
+		if(frac == 0.f) return sampleLevel<F, L, P, S, W>(x, y, (int)current);
+		float next = std::min(current + 1.f, (float)mMipLevels);
+		return sampleLevel<F, L, P, S, W>(x, y, (int)current) * (1.f - frac) +
+				sampleLevel<F, L, P, S, W>(x, y, (int)next) * frac;
+	}
+
+	//Four texels transposed, one color channel per register.
+	struct TexelBatch {
+		__m128 r, g, b, a;
+	};
+
+	//FastFloor for four lanes, rounds the same way.
+	static inline __m128i FloorBatch(__m128 v) {
+		__m128i negative = _mm_castps_si128(_mm_cmpnge_ps(v, _mm_setzero_ps()));
+		return _mm_add_epi32(_mm_cvttps_epi32(v), negative);
+	}
+
+	static inline __m128 Lerp(__m128 a, __m128 b, __m128 t) {
+		return _mm_add_ps(_mm_mul_ps(a, _mm_sub_ps(_mm_set1_ps(1.f), t)), _mm_mul_ps(b, t));
+	}
+
+	template<Format F, Layout L, bool P, Wraping W>
+	inline TexelBatch fetchBatch(const int* x, const int* y, const int* mipLevels) const {
+		vec4 t0 = fetch<F, L, P, W>(x[0], y[0], mipLevels[0]);
+		vec4 t1 = fetch<F, L, P, W>(x[1], y[1], mipLevels[1]);
+		vec4 t2 = fetch<F, L, P, W>(x[2], y[2], mipLevels[2]);
+		vec4 t3 = fetch<F, L, P, W>(x[3], y[3], mipLevels[3]);
+		TexelBatch batch = { _mm_loadu_ps(&t0.x), _mm_loadu_ps(&t1.x), _mm_loadu_ps(&t2.x), _mm_loadu_ps(&t3.x) };
+		_MM_TRANSPOSE4_PS(batch.r, batch.g, batch.b, batch.a);
+		return batch;
+	}
+
+	//Same arithmetic as sampleLevel, but every lane may come from its own mip level.
+	template<Format F, Layout L, bool P, Sampling S, Wraping W>
+	inline TexelBatch sampleLevelBatch(const float* x, const float* y, const int* mipLevels) const {
+		const ivec2& s0 = mLevels[mipLevels[0]].size;
+		const ivec2& s1 = mLevels[mipLevels[1]].size;
+		const ivec2& s2 = mLevels[mipLevels[2]].size;
+		const ivec2& s3 = mLevels[mipLevels[3]].size;
+		__m128 bx = _mm_mul_ps(_mm_loadu_ps(x), _mm_set_ps((float)s3.x, (float)s2.x, (float)s1.x, (float)s0.x));
+		__m128 by = _mm_mul_ps(_mm_loadu_ps(y), _mm_set_ps((float)s3.y, (float)s2.y, (float)s1.y, (float)s0.y));
+
+		__m128i floorX = FloorBatch(bx);
+		__m128i floorY = FloorBatch(by);
+
+		alignas(16) int sx[BatchWidth], sy[BatchWidth], sx1[BatchWidth], sy1[BatchWidth];
+		_mm_store_si128((__m128i*)sx, floorX);
+		_mm_store_si128((__m128i*)sy, floorY);
+
+		if(S == Sampling::None) return fetchBatch<F, L, P, W>(sx, sy, mipLevels);
+
+		__m128 fracX = _mm_sub_ps(bx, _mm_cvtepi32_ps(floorX));
+		__m128 fracY = _mm_sub_ps(by, _mm_cvtepi32_ps(floorY));
+
+		if(S == Sampling::CubicHermite) {
+			__m128 three = _mm_set1_ps(3.f), two = _mm_set1_ps(2.f);
+			fracX = _mm_mul_ps(_mm_mul_ps(fracX, fracX), _mm_sub_ps(three, _mm_mul_ps(two, fracX)));
+			fracY = _mm_mul_ps(_mm_mul_ps(fracY, fracY), _mm_sub_ps(three, _mm_mul_ps(two, fracY)));
+		}
+
+		__m128i one = _mm_set1_epi32(1);
+		_mm_store_si128((__m128i*)sx1, _mm_add_epi32(floorX, one));
+		_mm_store_si128((__m128i*)sy1, _mm_add_epi32(floorY, one));
+
+		TexelBatch a = fetchBatch<F, L, P, W>(sx, sy, mipLevels);
+		TexelBatch b = fetchBatch<F, L, P, W>(sx1, sy, mipLevels);
+		TexelBatch c = fetchBatch<F, L, P, W>(sx, sy1, mipLevels);
+		TexelBatch d = fetchBatch<F, L, P, W>(sx1, sy1, mipLevels);
+
+		__m128 invFracX = _mm_sub_ps(_mm_set1_ps(1.f), fracX);
+		__m128 fracXY = _mm_mul_ps(fracX, fracY);
+		auto blend = [&](__m128 a, __m128 b, __m128 c, __m128 d) {
+			__m128 v = _mm_add_ps(a, _mm_mul_ps(fracX, _mm_sub_ps(b, a)));
+			v = _mm_add_ps(v, _mm_mul_ps(_mm_mul_ps(fracY, _mm_sub_ps(c, a)), invFracX));
+			return _mm_add_ps(v, _mm_mul_ps(fracXY, _mm_sub_ps(d, b)));
+		};
+		TexelBatch out = { blend(a.r, b.r, c.r, d.r), blend(a.g, b.g, c.g, d.g), blend(a.b, b.b, c.b, d.b), blend(a.a, b.a, c.a, d.a) };
+		return out;
+	}
+
+	template<Format F, Layout L, bool P, Sampling S, Wraping W>
+	void sampleLevelsBatch(const float* x, const float* y, const float* mipLevel, vec4* out) const {
+		__m128 lod = _mm_max_ps(_mm_loadu_ps(mipLevel), _mm_set1_ps((float)mResidentLevel));
+		__m128i current = FloorBatch(lod);
+		__m128 frac = _mm_sub_ps(lod, _mm_cvtepi32_ps(current));
+
+		alignas(16) int levels[BatchWidth];
+		_mm_store_si128((__m128i*)levels, current);
+		TexelBatch batch = sampleLevelBatch<F, L, P, S, W>(x, y, levels);
+
+		//Lanes with no fraction blend by zero and come out exactly as sampleLevels returns them
+		if(_mm_movemask_ps(_mm_cmpneq_ps(frac, _mm_setzero_ps()))) {
+			__m128 next = _mm_min_ps(_mm_add_ps(_mm_cvtepi32_ps(current), _mm_set1_ps(1.f)), _mm_set1_ps((float)mMipLevels));
+			_mm_store_si128((__m128i*)levels, _mm_cvttps_epi32(next));
+			TexelBatch second = sampleLevelBatch<F, L, P, S, W>(x, y, levels);
+			batch.r = Lerp(batch.r, second.r, frac);
+			batch.g = Lerp(batch.g, second.g, frac);
+			batch.b = Lerp(batch.b, second.b, frac);
+			batch.a = Lerp(batch.a, second.a, frac);
+		}
+
+		_MM_TRANSPOSE4_PS(batch.r, batch.g, batch.b, batch.a);
+		_mm_storeu_ps(&out[0].x, batch.r);
+		_mm_storeu_ps(&out[1].x, batch.g);
+		_mm_storeu_ps(&out[2].x, batch.b);
+		_mm_storeu_ps(&out[3].x, batch.a);
+	}
+
+	//Fixed point filtering works on RGBA8 texels widened to 16 bit lanes, 
+	//0-255 becomes 0-65535. Weights are 16 bit fractions rounded to 8 bits.
+	template<Sampling S>
+	static inline int FixedWeight(int frac) {
+		int weight = (frac + 0x80) >> 8;
+		if(S == Sampling::CubicHermite) weight = (weight * weight * (768 - 2 * weight)) >> 8;
+		else weight <<= 8;
+		return std::min(weight, 0xFFFF);
+	}
+
+	//Blends the low four lanes of pair into the high four, the result is in the low four.
+	static inline __m128i LerpFixed(__m128i pair, int weight) {
+		__m128i weights = _mm_unpacklo_epi64(_mm_set1_epi16((short)(0xFFFF - weight)), _mm_set1_epi16((short)weight));
+		__m128i v = _mm_mulhi_epu16(pair, weights);
+		return _mm_add_epi16(v, _mm_srli_si128(v, 8));
+	}
+
+	static inline vec4 UnpackFixed(__m128i color) {
+		__m128 v = _mm_cvtepi32_ps(_mm_unpacklo_epi16(color, _mm_setzero_si128()));
+		v = _mm_mul_ps(v, _mm_set1_ps(1.f / 65535.f));
+		return *(vec4*)&v;
+	}
+
+	//Splits a texture coordinate into a texel and its 16 bit fraction. The coordinate is wrapped 
+	//or clamped into [0, 1] first, so the texel always fits, whatever the texture is tiled by.
+	template<Wraping W>
+	static inline void FixedCoordinate(float u, int size, int& texel, int& frac) {
+		u = W == Wraping::Repeat ? u - std::floor(u) : std::min(std::max(u, 0.f), 1.f);
+		float x = u * (float)size;
+		float floorX = std::floor(x);
+		//Truncating conversions that can't overflow, not even for NaNs.
+		texel = _mm_cvtt_ss2si(_mm_set_ss(floorX));
+		frac = _mm_cvtt_ss2si(_mm_set_ss((x - floorX) * 65536.f));
+	}
+
+	template<Layout L, bool P, Sampling S, Wraping W>
+	inline __m128i sampleLevelFixed(float u, float v, int mipLevel) const {
+		const MipLevel& level = mLevels[mipLevel];
+
+		int sx, sy, fracX, fracY;
+		FixedCoordinate<W>(u, level.size.x, sx, fracX);
+		FixedCoordinate<W>(v, level.size.y, sy, fracY);
+
+		__m128i texels = _mm_set_epi32(
+			*(const int*)texelAddress<Format::RGBA8, L, P, W>(level, sx + 1, sy + 1),
+			*(const int*)texelAddress<Format::RGBA8, L, P, W>(level, sx, sy + 1),
+			*(const int*)texelAddress<Format::RGBA8, L, P, W>(level, sx + 1, sy),
+			*(const int*)texelAddress<Format::RGBA8, L, P, W>(level, sx, sy));
+
+		int weightX = FixedWeight<S>(fracX);
+		int weightY = FixedWeight<S>(fracY);
+		__m128i top = LerpFixed(_mm_unpacklo_epi8(texels, texels), weightX);
+		__m128i bottom = LerpFixed(_mm_unpackhi_epi8(texels, texels), weightX);
+		return LerpFixed(_mm_unpacklo_epi64(top, bottom), weightY);
+	}
+
+	template<Layout L, bool P, Sampling S, Wraping W>
+	vec4 sampleLevelsFixed(float x, float y, float mipLevel) const {
+		mipLevel = std::max(mipLevel, (float)mResidentLevel);
+		//8.8 fixed point level, rounding can carry over to the next level.
+		int lod = (int)(mipLevel * 256.f + .5f);
+		int current = lod >> 8;
+		int frac = lod & 0xFF;
+		__m128i color = sampleLevelFixed<L, P, S, W>(x, y, current);
+		if(frac) {
+			int next = std::min(current + 1, mMipLevels);
+			color = LerpFixed(_mm_unpacklo_epi64(color, sampleLevelFixed<L, P, S, W>(x, y, next)), frac << 8);
+		}
+		return UnpackFixed(color);
+	}
+
+	template<Layout L, bool P, Sampling S, Wraping W>
+	void sampleLevelsFixedBatch(const float* x, const float* y, const float* mipLevel, vec4* out) const {
+		for(int i = 0; i < BatchWidth; i++) out[i] = sampleLevelsFixed<L, P, S, W>(x[i], y[i], mipLevel[i]);
+	}
+
+	//Index into the table of sampleLevels instantiations.
+	static constexpr int SampleFunctionIndex(Format format, Layout layout, bool powerOfTwo, bool fixedPoint, Sampling sampling, Wraping wraping) {
+		return (int)sampling + 3 * ((int)wraping + 2 * ((int)powerOfTwo + 2 * ((int)layout + 2 * ((int)format + 3 * (int)fixedPoint))));
+	}
+
+	static constexpr int SampleFunctionCount = 3 * 2 * 2 * 2 * 3 * 2;
+
+	template<int Count>
+	static void FillSampleFunctions(SampleFunction* functions, SampleBatchFunction* batchFunctions);
+
+	struct SampleFunctionTable {
+		std::vector<SampleFunction> functions;
+		std::vector<SampleBatchFunction> batchFunctions;
+	};
+
+	static const SampleFunctionTable& SampleFunctions();
+
+	static constexpr int Storage(Format format, Layout layout) { return (int)format * 2 + (int)layout; }
+
+	inline int storage() const { return Storage(mFormat, mLayout); }
+
+	//Texels allocated for a level, tiled levels are padded to whole blocks.
+	inline unsigned levelTexels(const MipLevel& level) const {
+		if(mLayout == Layout::Tiled) return level.blocksX * ((level.size.y + 3) >> 2) * 16;
+		return level.size.x * level.size.y;
+	}
+
+	public:
+
+		static inline int TexelSize(Format format) {
+			switch(format) {
+				case Format::RGB565: return 2;
+				case Format::F16: return 8;
+				default: return 4;
+			}
+		}
 	
 		Texture() = default; 
 		
 		Texture(const Texture& b) = delete; 
 		
 		Texture(Texture&& b) {
-			std::swap(mPixels, b.mPixels);
-			std::swap(mSize, b.mSize);
+			swap(b);
 		}
 
-		Texture(const std::string& path);
+		Texture(const std::string& path, Format format = Format::RGBA8, Layout layout = Layout::Linear);
 
-		~Texture() { delete [] mPixels; }
+		~Texture() { delete [] mData; }
 		
 		Texture& operator=(Texture&& b) {
-			std::swap(mPixels, b.mPixels);
-			std::swap(mSize, b.mSize);
+			swap(b);
 			return *this;
 		}
 
 		int mipLevels() const { return mMipLevels; }
 
+		//Loaded textures are cached in this directory in their final in-memory form, keyed by 
+		//the source path, size and modification time. Later loads map the cache file instead 
+		//of decoding the image. Empty disables the cache, which is the default.
+		static void SetCacheDirectory(const std::string& directory);
+
+		//True when the texels are mapped from the cache.
+		inline bool isCached() const { return mFile.isOpen(); }
+
+		//Finest mip level in memory, see setResidentLevel.
+		inline int residentLevel() const { return mResidentLevel; }
+
+		//Frees the levels finer than level, or copies them back from the cache when 
+		//level is finer than the resident one. False when there's no current cache, 
+		//the image has to be decoded again and passed to streamIn instead.
+		bool setResidentLevel(int level);
+
+		//Copies the levels from level up to the resident one from source, which is the 
+		//image loaded again. False if source no longer matches this texture.
+		bool streamIn(int level, const Texture& source);
+
+		inline bool isStreamable() const { return !mPath.empty(); }
 
-		bool load(const std::string& path);
+		//Image the texture was loaded from, empty for the created ones.
+		inline const std::string& path() const { return mPath; }
+
+		//Bytes of level and every coarser one.
+		unsigned levelBytes(int level) const;
+
+		inline unsigned residentBytes() const { return levelBytes(mResidentLevel); }
+
+		//Notes that level was sampled, safe to call from the rasterizer threads.
+		inline void requestLevel(int level) const {
+			int current = mRequestedLevel.load(std::memory_order_relaxed);
+			while(level < current && !mRequestedLevel.compare_exchange_weak(current, level, std::memory_order_relaxed));
+		}
+
+		//Finest level requested since the last call, INT_MAX if the texture wasn't sampled.
+		inline int takeRequestedLevel() { return mRequestedLevel.exchange(INT_MAX, std::memory_order_relaxed); }
+
+		bool load(const std::string& path, Format format = Format::RGBA8, Layout layout = Layout::Linear);
+
+		//Builds the texture from width * height texels in rows, top row first.
+		void create(int width, int height, std::vector<vec4> pixels, Format format = Format::RGBA8, Layout layout = Layout::Linear);
 		
 		int width() const { return mSize.x; }
 
 		int height() const { return mSize.y; }
 
-		inline vec4 sample(int x, int y, Wraping wraping = Wraping::Repeat) const {
-			unsigned sx, sy;
-			switch(wraping) {
-				case Wraping::Repeat: {
-					sx = (mTextureOffset.x + x) % (unsigned)mSize.x;
-					sy = (mTextureOffset.y + y) % (unsigned)mSize.y;
-				} break;
-				case Wraping::Clamp:
-					sx = Clamp(x, 0, mSize.x-1);
-					sy = Clamp(y, 0, mSize.y-1);
-				break;
+		inline Format format() const { return mFormat; }
+
+		inline Layout layout() const { return mLayout; }
+
+		//Filters with 8 bit weights on the packed texels instead of floats. Results are 
+		//within 0.9 of a step of 255 from the float path, fractional levels included. 
+		//Only black and white noise sampled between two levels goes slightly past one 
+		//step, as the x, y and level weights each round. Formats other than RGBA8 
+		//have no fixed point path and ignore this.
+		inline void setFixedPointFiltering(bool enable) { mFixedPoint = enable; }
+
+		inline bool isFixedPointFiltered() const { return mFixedPoint; }
+
+		//Texel fetch from the given mip level, x and y are in the texels of that level. 
+		//Evicted levels are read from the finest resident one instead.
+		template<Wraping W>
+		inline vec4 sample(int x, int y, int mipLevel) const {
+			if(mipLevel < mResidentLevel) {
+				x >>= mResidentLevel - mipLevel;
+				y >>= mResidentLevel - mipLevel;
+				mipLevel = mResidentLevel;
 			}
+			switch(storage()) {
+				case Storage(Format::RGBA8, Layout::Tiled): return fetch<Format::RGBA8, Layout::Tiled, false, W>(x, y, mipLevel);
+				case Storage(Format::RGB565, Layout::Linear): return fetch<Format::RGB565, Layout::Linear, false, W>(x, y, mipLevel);
+				case Storage(Format::RGB565, Layout::Tiled): return fetch<Format::RGB565, Layout::Tiled, false, W>(x, y, mipLevel);
+				case Storage(Format::F16, Layout::Linear): return fetch<Format::F16, Layout::Linear, false, W>(x, y, mipLevel);
+				case Storage(Format::F16, Layout::Tiled): return fetch<Format::F16, Layout::Tiled, false, W>(x, y, mipLevel);
+				default: return fetch<Format::RGBA8, Layout::Linear, false, W>(x, y, mipLevel);
+			}
+		}
 
-			return mPixels[sx + sy * mSize.x]; 
-		
+		inline vec4 sample(int x, int y, Wraping wraping = Wraping::Repeat) const {
+			return wraping == Wraping::Repeat ? sample<Wraping::Repeat>(x, y, 0) : sample<Wraping::Clamp>(x, y, 0);
 		}
 
+		//Resolves the sampling function for this texture's storage and the given sampler state.
+		SampleFunction sampleFunction(Sampling sampling, Wraping wraping) const;
+
+		//Same as sampleFunction, but for BatchWidth pixels per call.
+		SampleBatchFunction sampleBatchFunction(Sampling sampling, Wraping wraping) const;
+
 		vec4 sample(float x, float y, int mipLevel, Sampling sampling = Sampling::None, Wraping wraping = Wraping::Repeat) const;
 
 		inline vec4 sample(const vec2& vec, int mipLevel, Sampling sampling = Sampling::None, Wraping wraping = Wraping::Repeat) const { return sample(vec.x, vec.y, mipLevel, sampling, wraping); }
 
 		inline vec4 sample(float x, float y, float mipLevel, Sampling sampling = Sampling::None, Wraping wraping = Wraping::Repeat) const {
-		
-			float current = FastFloor(mipLevel);
-			float next = std::min(current + 1.f, (float)mMipLevels);
-			float frac = mipLevel - current;
-			return sample(x, y, (int)current, sampling, wraping) * (1.f - frac) +
-					sample(x, y, (int)next, sampling, wraping) * frac;
+			return (this->*sampleFunction(sampling, wraping))(x, y, mipLevel);
 		}
 
 		inline vec4 sample(const vec2& vec, float mipLevel, Sampling sampling = Sampling::None, Wraping wraping = Wraping::Repeat) const {
@@ -119,7 +586,28 @@ class Texture {
 
 };
 
+//Immutable sampler state, resolved against a texture once per draw.
+class Sampler {
 
-#endif //TEXTURE_HPP
+	Texture::Sampling mSampling;
+	Texture::Wraping mWraping;
+
+	public:
+
+		Sampler(Texture::Sampling sampling = Texture::Sampling::None, Texture::Wraping wraping = Texture::Wraping::Repeat):
+			mSampling(sampling),
+			mWraping(wraping)
+		{}
 
+		inline Texture::Sampling sampling() const { return mSampling; }
 
+		inline Texture::Wraping wraping() const { return mWraping; }
+
+		inline Texture::SampleFunction resolve(const Texture& texture) const { return texture.sampleFunction(mSampling, mWraping); }
+
+		inline Texture::SampleBatchFunction resolveBatch(const Texture& texture) const { return texture.sampleBatchFunction(mSampling, mWraping); }
+
+};
+
+
+#endif //TEXTURE_HPP
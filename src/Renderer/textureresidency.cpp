@@ -0,0 +1,111 @@
+/*
+Copyright © 2018, Marko Ranta
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "textureresidency.hpp"
+#include <algorithm>
+
+void TextureResidency::add(Texture& texture) {
+	mEntries.push_back({ &texture, std::vector<unsigned>(texture.mipLevels() + 1, mFrame), AssetHandle<Texture>(), false });
+}
+
+void TextureResidency::remove(Texture& texture) {
+	mEntries.erase(std::remove_if(mEntries.begin(), mEntries.end(), [&texture](const Entry& entry) {
+		return entry.texture == &texture;
+	}), mEntries.end());
+}
+
+size_t TextureResidency::residentBytes() const {
+	size_t bytes = 0;
+	for(const Entry& entry : mEntries) bytes += entry.texture->residentBytes();
+	return bytes;
+}
+
+bool TextureResidency::evict(size_t target, unsigned protectedFrame) {
+	size_t bytes = residentBytes();
+	while(bytes > target) {
+		//Only the finest resident level of a texture can go, and the coarsest one always stays.
+		Entry* oldest = nullptr;
+		for(Entry& entry : mEntries) {
+			Texture* texture = entry.texture;
+			int level = texture->residentLevel();
+			if(!texture->isStreamable() || level >= texture->mipLevels()) continue;
+			if(entry.lastUsed[level] >= protectedFrame) continue;
+			if(!oldest || entry.lastUsed[level] < oldest->lastUsed[oldest->texture->residentLevel()]) oldest = &entry;
+		}
+		if(!oldest) return false;
+
+		Texture* texture = oldest->texture;
+		bytes -= texture->residentBytes();
+		texture->setResidentLevel(texture->residentLevel() + 1);
+		bytes += texture->residentBytes();
+		mEvictedLevels++;
+	}
+	return true;
+}
+
+void TextureResidency::update() {
+	mFrame++;
+
+	//A sampled level uses the coarser ones too, as trilinear filtering blends in the next one.
+	std::vector<int> requested(mEntries.size());
+	for(size_t i = 0; i < mEntries.size(); i++) {
+		Entry& entry = mEntries[i];
+		Texture* texture = entry.texture;
+		if(entry.lastUsed.size() != (size_t)texture->mipLevels() + 1) entry.lastUsed.assign(texture->mipLevels() + 1, mFrame);
+		requested[i] = texture->takeRequestedLevel();
+		for(int level = std::max(requested[i], 0); level <= texture->mipLevels(); level++) entry.lastUsed[level] = mFrame;
+	}
+
+	//Streaming in may only evict levels that weren't sampled in this frame.
+	for(size_t i = 0; i < mEntries.size(); i++) {
+		Entry& entry = mEntries[i];
+		Texture* texture = entry.texture;
+		int level = std::max(requested[i], 0);
+		int resident = texture->residentLevel();
+		if(level >= resident || !texture->isStreamable()) continue;
+		if(entry.reloading && entry.reload.status() == AssetHandle<Texture>::Status::Pending) continue;
+
+		size_t extra = texture->levelBytes(level) - texture->residentBytes();
+		if(extra > mBudget || !evict(mBudget - extra, mFrame)) continue;
+
+		//A finished reload is used once, whether it still matches or not.
+		bool streamed;
+		if(entry.reloading) {
+			streamed = entry.reload.isReady() && texture->streamIn(level, *entry.reload.get());
+			entry.reload = AssetHandle<Texture>();
+			entry.reloading = false;
+		} else {
+			streamed = texture->setResidentLevel(level);
+			if(!streamed && mLoader) {
+				entry.reload = mLoader->load<Texture>(texture->path(), nullptr, texture->format(), texture->layout());
+				entry.reloading = true;
+			}
+		}
+		if(streamed) mStreamedLevels += resident - level;
+	}
+
+	evict(mBudget, mFrame + 1);
+}
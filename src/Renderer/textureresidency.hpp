@@ -0,0 +1,88 @@
+/*
+Copyright © 2018, Marko Ranta
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef TEXTURERESIDENCY_HPP
+#define TEXTURERESIDENCY_HPP
+
+#include "texture.hpp"
+#include "../System/assetloader.hpp"
+#include <vector>
+
+//Keeps the mip levels of the added textures within a byte budget. The finest 
+//levels that haven't been sampled for the longest are evicted first, and levels 
+//the rasterizer asks for again are streamed back in when they fit. They are copied 
+//from the texture cache, or without one decoded on an asset loader and copied in 
+//by a later update.
+class TextureResidency {
+
+	struct Entry {
+		Texture* texture;
+		std::vector<unsigned> lastUsed; //Frame each level was last sampled in
+		AssetHandle<Texture> reload; //Source decoded again for streaming in, when reloading
+		bool reloading;
+	};
+
+	std::vector<Entry> mEntries;
+	size_t mBudget;
+	AssetLoader* mLoader;
+	unsigned mFrame = 0;
+
+	unsigned mEvictedLevels = 0;
+	unsigned mStreamedLevels = 0;
+
+	//Evicts least recently used levels, which weren't used at or after 
+	//protectedFrame, until the resident bytes fit in target.
+	bool evict(size_t target, unsigned protectedFrame);
+
+	public:
+
+		//Without a loader, levels are only streamed in from the texture cache.
+		TextureResidency(size_t budget, AssetLoader* loader = nullptr):
+			mBudget(budget),
+			mLoader(loader)
+		{}
+
+		inline void setBudget(size_t budget) { mBudget = budget; }
+
+		inline size_t budget() const { return mBudget; }
+
+		void add(Texture& texture);
+
+		void remove(Texture& texture);
+
+		//Collects the levels sampled since the last update, streams them in and evicts 
+		//over the budget. Call between frames, while nothing is being rendered.
+		void update();
+
+		size_t residentBytes() const;
+
+		inline unsigned evictedLevels() const { return mEvictedLevels; }
+
+		inline unsigned streamedLevels() const { return mStreamedLevels; }
+
+};
+
+#endif //TEXTURERESIDENCY_HPP
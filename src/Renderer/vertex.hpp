@@ -184,6 +184,15 @@ inline float TriangleAreaDoubled(const Vertex& a, const Vertex& b, const Vertex&
 	return x1 * y2 - x2 * y1;
 }
 
+//Determinant of the clip space x, y and w components, its sign tells the facing 
+//of the triangle even before clipping, and it's zero for degenerate triangles.
+inline float HomogeneousDeterminant(const Vertex& a, const Vertex& b, const Vertex& c) {
+	return 
+		a.x() * (b.y() * c.w() - c.y() * b.w()) -
+		a.y() * (b.x() * c.w() - c.x() * b.w()) +
+		a.w() * (b.x() * c.y() - c.x() * b.y());
+}
+
 static bool ClipEdge(const Plane& plane, const Vertex& a, const Vertex& b, Vertex& c) {
 
 	c = Vertex();
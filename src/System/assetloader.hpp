@@ -0,0 +1,122 @@
+/*
+Copyright © 2018, Marko Ranta
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef ASSETLOADER_HPP
+#define ASSETLOADER_HPP
+
+#include "threadpool.hpp"
+#include <string>
+#include <future>
+
+template<class T>
+class AssetHandle {
+
+	public:
+
+		enum class Status {
+			Pending,
+			Ready,
+			Failed
+		};
+
+	private:
+
+		friend class AssetLoader;
+
+		//Shared with the loading job, which publishes the asset through it.
+		struct State {
+			T asset;
+			std::atomic<Status> status{ Status::Pending };
+			std::promise<bool> done;
+
+			void publish(bool loaded) {
+				status.store(loaded ? Status::Ready : Status::Failed, std::memory_order_release);
+				done.set_value(loaded);
+			}
+		};
+
+		std::shared_ptr<State> mState;
+		std::shared_future<bool> mDone;
+		const T* mPlaceholder = nullptr;
+
+		AssetHandle(const std::shared_ptr<State>& state, const T* placeholder):
+			mState(state),
+			mDone(state->done.get_future().share()),
+			mPlaceholder(placeholder)
+		{}
+
+	public:
+
+		AssetHandle() = default;
+
+		inline Status status() const { return mState ? mState->status.load(std::memory_order_acquire) : Status::Failed; }
+
+		inline bool isReady() const { return status() == Status::Ready; }
+
+		//The loaded asset, or the placeholder while it's still loading or if loading failed.
+		inline const T* get() const { return isReady() ? &mState->asset : mPlaceholder; }
+
+		//Blocks until the load has finished, returns whether it succeeded.
+		inline bool wait() const { return mDone.valid() && mDone.get(); }
+
+		inline const std::shared_future<bool>& future() const { return mDone; }
+
+};
+
+//Loads assets on a pool of worker threads, so decoding and parsing 
+//overlap each other and the render loop keeps going meanwhile.
+class AssetLoader {
+
+	ThreadPool mPool;
+
+	public:
+
+		AssetLoader(unsigned threads = std::thread::hardware_concurrency()):
+			mPool(threads)
+		{}
+
+		//Queued loads are finished before the loader goes away.
+		~AssetLoader() = default;
+
+		//Queues T::load(path, args...), the handle returns placeholder until it's done.
+		template<class T, class... Args>
+		AssetHandle<T> load(const std::string& path, const T* placeholder, Args... args) {
+			std::shared_ptr<typename AssetHandle<T>::State> state = std::make_shared<typename AssetHandle<T>::State>();
+			AssetHandle<T> handle(state, placeholder);
+			mPool.enqueue([state, path, args...]() {
+				//A throwing load fails the asset, its waiters would block forever otherwise.
+				bool loaded = false;
+				try {
+					loaded = state->asset.load(path, args...);
+				} catch(...) {}
+				state->publish(loaded);
+			});
+			return handle;
+		}
+
+};
+
+#endif //ASSETLOADER_HPP
@@ -0,0 +1,131 @@
+/*
+Copyright © 2018, Marko Ranta
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "mappedfile.hpp"
+#include <fstream>
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+bool MappedFile::open(const std::string& path) {
+	close();
+
+	#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if(file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+
+	//The mapping keeps the file open, so its handle isn't needed after this.
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if(!mapping) return false;
+
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if(!view) {
+		CloseHandle(mapping);
+		return false;
+	}
+
+	mHandle = mapping;
+	mData = (const unsigned char*)view;
+	mSize = (size_t)size.QuadPart;
+	#else
+	int file = ::open(path.c_str(), O_RDONLY);
+	if(file < 0) return false;
+
+	struct stat info;
+	if(fstat(file, &info) != 0 || info.st_size == 0) {
+		::close(file);
+		return false;
+	}
+
+	void* view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	::close(file);
+	if(view == MAP_FAILED) return false;
+
+	mData = (const unsigned char*)view;
+	mSize = (size_t)info.st_size;
+	#endif
+
+	return true;
+}
+
+void MappedFile::close() {
+	if(!mData) return;
+
+	#ifdef _WIN32
+	UnmapViewOfFile(mData);
+	CloseHandle((HANDLE)mHandle);
+	#else
+	munmap((void*)mData, mSize);
+	#endif
+
+	mData = nullptr;
+	mSize = 0;
+	mHandle = nullptr;
+}
+
+bool MappedFile::Stat(const std::string& path, unsigned long long& size, unsigned long long& modified) {
+	struct stat info;
+	if(stat(path.c_str(), &info) != 0) return false;
+	size = (unsigned long long)info.st_size;
+	modified = (unsigned long long)info.st_mtime;
+	return true;
+}
+
+bool MappedFile::Write(const std::string& path, const std::function<void(std::ostream&)>& write) {
+	std::string tempPath = path + ".tmp";
+	{
+		std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+		if(!out) return false;
+		write(out);
+		if(!out) {
+			out.close();
+			remove(tempPath.c_str());
+			return false;
+		}
+	}
+	//Renaming over an existing file fails on Windows.
+	remove(path.c_str());
+	if(rename(tempPath.c_str(), path.c_str()) != 0) {
+		remove(tempPath.c_str());
+		return false;
+	}
+	return true;
+}
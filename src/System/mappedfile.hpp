@@ -0,0 +1,83 @@
+/*
+Copyright © 2018, Marko Ranta
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <string>
+#include <utility>
+#include <functional>
+#include <iosfwd>
+
+//Read only view of a whole file mapped into memory.
+class MappedFile {
+
+	const unsigned char* mData = nullptr;
+	size_t mSize = 0;
+	void* mHandle = nullptr; //Windows file mapping object
+
+	public:
+
+		MappedFile() = default;
+		MappedFile(const MappedFile&) = delete;
+
+		MappedFile(MappedFile&& b) { swap(b); }
+
+		~MappedFile() { close(); }
+
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		MappedFile& operator=(MappedFile&& b) {
+			swap(b);
+			return *this;
+		}
+
+		bool open(const std::string& path);
+
+		void close();
+
+		inline bool isOpen() const { return mData != nullptr; }
+
+		inline const unsigned char* data() const { return mData; }
+
+		inline size_t size() const { return mSize; }
+
+		inline void swap(MappedFile& b) {
+			std::swap(mData, b.mData);
+			std::swap(mSize, b.mSize);
+			std::swap(mHandle, b.mHandle);
+		}
+
+		//Size and last modification time of the file, false if it doesn't exist.
+		static bool Stat(const std::string& path, unsigned long long& size, unsigned long long& modified);
+
+		//Writes the file next to path and renames it over path, so that a partial file 
+		//is never mapped. False when writing or renaming fails.
+		static bool Write(const std::string& path, const std::function<void(std::ostream&)>& write);
+
+};
+
+#endif //MAPPEDFILE_HPP
@@ -0,0 +1,105 @@
+/*
+Copyright © 2018, Marko Ranta
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "threadpool.hpp"
+
+ThreadPool::ThreadPool(unsigned threads) {
+	if(threads == 0) threads = 1;
+	mThreads.reserve(threads);
+	for(unsigned i = 0; i < threads; i++) {
+		mThreads.emplace_back(&ThreadPool::workerLoop, this);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mJobAvailable.notify_all();
+	for(auto& thread : mThreads) {
+		thread.join();
+	}
+}
+
+void ThreadPool::enqueue(std::function<void()> job) {
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mJobs.emplace_back(std::move(job));
+	}
+	mJobAvailable.notify_one();
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int)>& job) {
+	if(count <= 0) return;
+
+	//The state is shared, because helper jobs may get picked up 
+	//only after the calling thread has already finished everything.
+	struct Work {
+		std::atomic<int> next{ 0 };
+		std::atomic<int> done{ 0 };
+		std::mutex mutex;
+		std::condition_variable finished;
+	};
+	auto work = std::make_shared<Work>();
+	const std::function<void(int)>* func = &job;
+	int total = count;
+
+	auto run = [work, func, total]() {
+		int completed = 0;
+		for(int i = work->next++; i < total; i = work->next++) {
+			(*func)(i);
+			completed++;
+		}
+		if(completed && (work->done += completed) == total) {
+			std::lock_guard<std::mutex> lock(work->mutex);
+			work->finished.notify_all();
+		}
+	};
+
+	int helpers = std::min((int)mThreads.size(), count - 1);
+	for(int i = 0; i < helpers; i++) {
+		enqueue(run);
+	}
+	run();
+
+	std::unique_lock<std::mutex> lock(work->mutex);
+	work->finished.wait(lock, [&work, total]() { return work->done == total; });
+}
+
+void ThreadPool::workerLoop() {
+	for(;;) {
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mJobAvailable.wait(lock, [this]() { return mQuit || !mJobs.empty(); });
+			if(mQuit && mJobs.empty()) return;
+			job = std::move(mJobs.front());
+			mJobs.pop_front();
+		}
+		job();
+	}
+}
@@ -0,0 +1,72 @@
+/*
+Copyright © 2018, Marko Ranta
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+
+//A simple fixed size pool of worker threads. ~MaGetzUb
+class ThreadPool {
+
+	std::vector<std::thread> mThreads;
+	std::deque<std::function<void()>> mJobs;
+
+	std::mutex mMutex;
+	std::condition_variable mJobAvailable;
+
+	bool mQuit = false;
+
+	public:
+
+		ThreadPool(unsigned threads = std::thread::hardware_concurrency());
+		ThreadPool(const ThreadPool&) = delete;
+		~ThreadPool();
+
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		void enqueue(std::function<void()> job);
+
+		//Calls job(index) for every index in [0, count), the calling thread 
+		//takes part in the work too. Returns once all the indices are done.
+		void parallelFor(int count, const std::function<void(int)>& job);
+
+		inline unsigned threadCount() const { return (unsigned)mThreads.size(); }
+
+	private:
+
+		void workerLoop();
+
+};
+
+#endif //THREADPOOL_HPP
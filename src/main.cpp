@@ -28,6 +28,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "Renderer/canvas.hpp"
 #include "System/inputmanager.hpp"
 #include "System/timer.hpp"
+#include "System/assetloader.hpp"
 #include <string>
 #include <iostream>
 #include <regex> //MEH
@@ -123,22 +124,25 @@ int main()
 	RenderContext rc(canvas);
 
 
-	Texture texture1;
-	texture1.load("res/texture1.png");
+	//Decoded textures and their mips are kept in the cache, next start maps them instead.
+	Texture::SetCacheDirectory("res/");
 
+	//Assets load in the background, textures are flat grey until then and meshes are skipped.
+	AssetLoader loader;
 
-	Texture texture2;
-	texture2.load("res/texture2.png");
+	Texture placeholder;
+	placeholder.create(1, 1, { vec4(.5f, .5f, .5f, 1.f) });
 
+	AssetHandle<Texture> texture1 = loader.load<Texture>("res/texture1.png", &placeholder);
 
-	Mesh mesh1;
-	mesh1.load("res/suzanne.obj");
+	AssetHandle<Texture> texture2 = loader.load<Texture>("res/texture2.png", &placeholder);
 
-	Mesh mesh2;
-	mesh2.load("res/terrain.obj");
 
-	Mesh mesh3;
-	mesh3.load("res/cube.obj");
+	AssetHandle<Mesh> mesh1 = loader.load<Mesh>("res/suzanne.obj", nullptr);
+
+	AssetHandle<Mesh> mesh2 = loader.load<Mesh>("res/terrain.obj", nullptr);
+
+	AssetHandle<Mesh> mesh3 = loader.load<Mesh>("res/cube.obj", nullptr);
 
 	#endif 
 
@@ -251,6 +255,11 @@ int main()
 		if(inputs.isKeyHit(0x32)) rc.setSamplingMode(Texture::Sampling::Linear);
 		if(inputs.isKeyHit(0x33)) rc.setSamplingMode(Texture::Sampling::CubicHermite);
 
+		if(inputs.isKeyHit('T')) rc.enableTiledRendering(!rc.isTiledRendering());
+		if(inputs.isKeyHit('H')) rc.setRasterizer(rc.rasterizer() == RenderContext::Rasterizer::Scanline ? RenderContext::Rasterizer::HalfSpace : RenderContext::Rasterizer::Scanline);
+		if(inputs.isKeyHit('Z')) rc.enableHierarchicalZ(!rc.isHierarchicalZ());
+		if(inputs.isKeyHit('B')) rc.setCullMode((RenderContext::CullMode)(((int)rc.cullMode() + 1) % 3));
+
 		if(inputs.isKeyDown('W')) cameraPosition += dir*5.f * deltaTime;
 		if(inputs.isKeyDown('S')) cameraPosition -= dir*5.f * deltaTime;
 		if(inputs.isKeyDown('D')) cameraPosition += right*5.f * deltaTime;
@@ -272,17 +281,17 @@ int main()
 		mat4 suzanneRotation = mat4::Rotation(QMod(suzanneAngle, 360.0f), 0.f, 1.f, 0.f);
 		mat4 model = mat4::Translate(0.0f, 0.0f, -2.0f)  * suzanneRotation;
 		mat = viewProjection * model;
-		rc.drawMesh(mesh1, mat, texture1, suzanneRotation);
+		if(mesh1.isReady()) rc.drawMesh(*mesh1.get(), mat, *texture1.get(), suzanneRotation);
 
 		suzanneAngle += deltaTime*20.f;
 
 		model = mat4::Translate(0.0f, -4.0f, 0.0f);
 		mat = viewProjection * model;
-		rc.drawMesh(mesh2, mat, texture2);
+		if(mesh2.isReady()) rc.drawMesh(*mesh2.get(), mat, *texture2.get());
 
 		model = mat4::Translate(0.0f, -2.0f, -2.0f);
 		mat = viewProjection * model;
-		rc.drawMesh(mesh3, mat);
+		if(mesh3.isReady()) rc.drawMesh(*mesh3.get(), mat);
 		#endif 
 
 
@@ -329,7 +338,7 @@ int main()
 			fpsTime = 0;
 		}
 
-		window.setTitle("Software Rendering | FPS: " + std::to_string(fps) + " | Triangles: "+std::to_string(rc.renderedTriangles()) /*+ (rc.isMipMapTesting() ? " | MipMap testing! " + std::to_string(rc.mipMapLevel()) : "")*/);
+		window.setTitle("Software Rendering | FPS: " + std::to_string(fps) + " | Triangles: "+std::to_string(rc.renderedTriangles()) + " | Clipped: " + std::to_string(rc.clipStats().clippedTriangles) /*+ (rc.isMipMapTesting() ? " | MipMap testing! " + std::to_string(rc.mipMapLevel()) : "")*/);
 
 
 		inputs.update();
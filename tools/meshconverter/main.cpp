@@ -0,0 +1,85 @@
+/*
+Copyright © 2018, Marko Ranta
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+	1. Redistributions of source code must retain the above copyright
+	   notice, this list of conditions and the following disclaimer.
+
+	2. Redistributions in binary form must reproduce the above copyright
+	   notice, this list of conditions and the following disclaimer in the
+	   documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "../../src/Renderer/mesh.hpp"
+#include "../../src/System/threadpool.hpp"
+#include <chrono>
+#include <cstdio>
+
+//Converts OBJ files into binary meshes, which Mesh::load maps without parsing. 
+//The meshes are optimized for vertex cache reuse unless told otherwise, 
+//and can be split into meshlets for culling them in parts.
+int main(int argc, char** argv) {
+	bool optimize = true, meshlets = false;
+	std::vector<std::string> paths;
+	for(int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if(arg == "--no-optimize") optimize = false;
+		else if(arg == "--meshlets") meshlets = true;
+		else paths.push_back(arg);
+	}
+
+	if(paths.empty() || paths.size() > 2) {
+		fprintf(stderr, "Usage: %s [--no-optimize] [--meshlets] input.obj [output.mesh]\n", argv[0]);
+		return 1;
+	}
+
+	std::string input = paths[0];
+	size_t dot = input.find_last_of('.'), slash = input.find_last_of("/\\");
+	std::string name = dot != std::string::npos && (slash == std::string::npos || dot > slash) ? input.substr(0, dot) : input;
+	std::string output = paths.size() > 1 ? paths[1] : name + ".mesh";
+	if(output == input) output += ".mesh";
+
+	ThreadPool pool;
+	Mesh mesh;
+	auto start = std::chrono::steady_clock::now();
+	if(!mesh.load(input, &pool)) {
+		fprintf(stderr, "Couldn't load %s\n", input.c_str());
+		return 1;
+	}
+	double loadTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	printf("%s: %u vertices, %u triangles, loaded in %.1f ms\n", input.c_str(), mesh.vertexCount(), mesh.triangleCount(), loadTime);
+
+	if(optimize) {
+		start = std::chrono::steady_clock::now();
+		Mesh::Optimization result = mesh.optimize();
+		double optimizeTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		printf("ACMR %.3f -> %.3f, optimized in %.1f ms\n", result.acmrBefore, result.acmrAfter, optimizeTime);
+	}
+
+	if(meshlets) {
+		mesh.buildMeshlets();
+		printf("%u meshlets, %u vertices with the shared ones duplicated\n", (unsigned)mesh.meshlets().size(), mesh.vertexCount());
+	}
+
+	if(!mesh.saveBinary(output)) {
+		fprintf(stderr, "Couldn't write %s\n", output.c_str());
+		return 1;
+	}
+
+	printf("Wrote %s\n", output.c_str());
+	return 0;
+}